@@ -3,27 +3,101 @@
  *
  * Max Franklin
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <signal.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
 #include <errno.h>
+#include <time.h>
 
 /* Misc manifest constants */
 #define MAXLINE 1024   /* max line size */
 #define MAXARGS 128    /* max args on a command line */
 #define MAXJOBS 16     /* max jobs at any point in time */
 #define MAXJID 1 << 16 /* max job ID */
+#define MAXCLIENTS 8   /* max control socket clients */
+#define MAXEVENTS 256  /* max undelivered job-state events */
+#define MAXLOGS 32     /* max captured job outputs kept at once */
+#define LOGSIZE 65536  /* bytes of output kept per captured job */
+#define READSIZE 65536 /* bytes drained from a capture pipe per read */
+#define DENTSIZE 1048576 /* bytes of directory entries read per getdents64 */
+#define MAXDIRCACHE 64 /* directory listings kept for glob expansion */
+#define ARENACHUNK 65536 /* bytes per chunk of expanded words */
+#define MAXSUBSTS 16 /* max process substitutions in one command */
+#define MAXTOKENS 512  /* max words and operators on a command line */
+#define MAXNODES 256   /* max nodes in a command line's plan */
+#define MAXPLANS 32    /* parsed lines kept for reuse */
+#define MAXVARS 64     /* max distinct variable names */
+#define VARNAME 32     /* max variable name length, with the NUL */
+#define VARMARK '\001' /* marks a variable reference in a word */
+#define ZYGOTEMSG 131072 /* max size of a spawn request to the zygote */
+#define SCHEDTICK 250000000L /* ns between load checks while jobs are queued */
+#define WATCHQUIET 100 /* ms without changes before watch reruns */
+#define CACHEENV "PATH:LANG:LC_ALL:TZ" /* variables a cached run depends on */
+#define CACHEMAGIC 0x63687374 /* marks a stored cache entry */
+#define HISTSUB 5      /* bits of precision kept by a latency histogram */
+#define HISTBUCKETS ((64 - HISTSUB + 1) << HISTSUB) /* buckets per histogram */
+
+/* Priority classes for queued jobs */
+#define PRIO_HIGH 0
+#define PRIO_NORMAL 1
+#define PRIO_LOW 2
+
+/* pidfd flag for signalling a whole process group (Linux 6.9+) */
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1UL << 2)
+#endif
 
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
+#define QU 4    /* queued, waiting for the scheduler */
+
+/* Plan node types */
+#define N_CMD 0   /* simple command */
+#define N_SEQ 1   /* left ; right */
+#define N_AND 2   /* left && right */
+#define N_OR 3    /* left || right */
+#define N_BG 4    /* left & */
+#define N_GROUP 5 /* ( left ) */
+#define N_FOR 6   /* for var in words ; do left ; done */
+#define N_WHILE 7 /* while left ; do right ; done */
+
+/* Token types */
+#define T_WORD 0   /* a word */
+#define T_SEMI 1   /* ; */
+#define T_AMP 2    /* & */
+#define T_AND 3    /* && */
+#define T_OR 4     /* || */
+#define T_LPAREN 5 /* ( */
+#define T_RPAREN 6 /* ) */
+#define T_END 7    /* end of line */
+
+/* Job-state events reported to control socket clients */
+#define EV_STARTED 0   /* job launched */
+#define EV_STOPPED 1   /* job stopped by a signal */
+#define EV_CONTINUED 2 /* job continued by bg, fg or a client */
+#define EV_EXITED 3    /* job exited normally */
+#define EV_SIGNALED 4  /* job terminated by a signal */
 
 /*
  * Jobs states: FG (foreground), BG (background), ST (stopped)
@@ -32,6 +106,8 @@
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
+ *     QU -> BG  : admitted by the scheduler, or bg command
+ *     QU -> FG  : fg command
  * At most 1 job can be in the FG state.
  */
 
@@ -45,11 +121,214 @@ char sbuf[MAXLINE];      /* for composing sprintf messages */
 struct job_t
 {                          /* The job struct */
     pid_t pid;             /* job PID */
+    int pidfd;             /* pidfd pinning the job PID, -1 if none */
     int jid;               /* job ID [1, 2, ...] */
-    int state;             /* UNDEF, BG, FG, or ST */
+    int state;             /* UNDEF, BG, FG, ST, or QU */
+    int prio;              /* QU: PRIO_HIGH, PRIO_NORMAL or PRIO_LOW */
+    unsigned int seq;      /* QU: queueing order within a class */
+    long long start;       /* when the job was launched, in ns */
+    struct queued_t *queued; /* QU: what it needs to start later */
     char cmdline[MAXLINE]; /* command line */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
+int laststatus = 0;         /* exit status of the last command */
+int cancelled = 0;          /* if true, the last command ended by ctrl-c */
+int subshell = 0;           /* if true, we are a forked list runner */
+volatile sig_atomic_t fgreaped = 0; /* last foreground pid the handler saw */
+volatile sig_atomic_t fgstatus = 0; /* and its wait status */
+volatile long long fgreapns = 0;    /* and when, in ns */
+
+int sched_on = 0;           /* if true, background jobs are admitted */
+double sched_cpu = 20.0;    /* max cpu PSI some avg10 (%) to admit at */
+double sched_memory = 10.0; /* max memory PSI some avg10 (%) */
+double sched_io = 20.0;     /* max io PSI some avg10 (%) */
+int sched_runq = 0;         /* max runnable tasks, 0 for 2 per CPU */
+int sched_max = 0;          /* max running background jobs, 0 for 1 per CPU */
+unsigned int queueseq = 0;  /* next queued job sequence number */
+int launchdir = -1;         /* directory the next launch starts in, -1 for ours */
+
+struct node_t
+{              /* A node of a parsed command line */
+    int type;  /* N_CMD, N_SEQ, N_AND, N_OR, N_BG, N_GROUP, ... */
+    int left;  /* first operand node */
+    int right; /* second operand node; N_FOR: the variable's slot */
+    int argv;  /* N_CMD, N_FOR: index of the first word */
+    int argc;  /* N_CMD, N_FOR: number of words */
+    int start; /* offset of the node's text in the line */
+    int end;   /* offset just past the node's text */
+};
+
+struct plan_t
+{                                 /* A parsed command line */
+    const char *line;             /* the line as typed */
+    int root;                     /* top node, -1 for a blank line */
+    int nnodes;                   /* nodes in use */
+    int nwords;                   /* words in use */
+    int len;                      /* bytes of buf in use */
+    int busy;                     /* evaluations running it right now */
+    struct node_t nodes[MAXNODES];
+    int words[MAXARGS];           /* offset of each word in buf */
+    char globs[MAXARGS];          /* word is an unquoted pattern */
+    char substs[MAXARGS];         /* '<' or '>' if the word is <(...) or >(...) */
+    char vars[MAXARGS];           /* word refers to variables */
+    char buf[MAXLINE + MAXARGS];  /* NUL-terminated words */
+};
+
+struct args_t
+{                /* The words of a simple command after expansion */
+    char **argv; /* NULL-terminated words */
+    int argc;    /* words in argv */
+    int cap;     /* slots allocated for argv */
+    char *chunk; /* newest arena chunk, which links to the one before */
+    size_t used; /* bytes used in chunk */
+    size_t size; /* bytes in chunk */
+    int nsubs;   /* process substitutions started for these words */
+    pid_t subs[MAXSUBSTS];  /* their pids */
+    int subfds[MAXSUBSTS];  /* our end of each one's pipe */
+};
+
+struct queued_t
+{                       /* What a queued job is started from */
+    struct plan_t plan; /* copy of the plan it was submitted from */
+    char line[MAXLINE]; /* the line that plan points into */
+    int node;           /* the job's node in plan */
+    int cwd;            /* directory it was submitted in, -1 if unknown */
+    int expanded;       /* args holds a simple command's words */
+    struct args_t args; /* those words, expanded when it was submitted */
+    int nvals;          /* variable slots in use when it was submitted */
+    char *vals[MAXVARS]; /* and their values, for a list to run with */
+    int status;         /* $? when it was submitted */
+};
+
+struct dirlist_t
+{                            /* A cached directory listing */
+    dev_t dev;               /* directory identity */
+    ino_t ino;
+    struct timespec mtime;   /* its mtime when it was read */
+    int n;                   /* entries, without . and .. */
+    int cap;                 /* slots allocated in offs and types */
+    unsigned int *offs;      /* offset of each name in names */
+    unsigned char *types;    /* d_type of each entry */
+    char *names;             /* NUL-terminated names */
+    size_t size;             /* bytes allocated for names */
+    unsigned int seq;        /* last use, to recycle the oldest */
+    int busy;                /* expansions walking it right now */
+};
+struct dirlist_t dircache[MAXDIRCACHE]; /* listings by directory */
+unsigned int dirseq = 0;                /* next dirlist_t use number */
+
+struct planent_t
+{                       /* A parsed line kept for reuse */
+    uint64_t hash;      /* xxh64 of the line, 0 if the slot is free */
+    unsigned int seq;   /* last use, to recycle the oldest */
+    char line[MAXLINE]; /* the line the plan points into */
+    struct plan_t plan;
+};
+struct planent_t plancache[MAXPLANS]; /* plans by line text */
+unsigned int planseq = 0;             /* next planent_t use number */
+unsigned long plan_hits = 0;          /* lines run from a cached plan */
+unsigned long plan_misses = 0;        /* lines that had to be parsed */
+long long parse_ns = 0;               /* time spent parsing them */
+
+struct var_t
+{                        /* A shell variable slot */
+    char name[VARNAME];  /* variable name, or "?" */
+    char *value;         /* set by for, NULL to use the environment */
+};
+struct var_t vars[MAXVARS]; /* slots that words refer to by number */
+int nvars = 0;              /* slots in use */
+
+struct token_t
+{              /* A word or operator */
+    int type;  /* T_WORD, T_SEMI, ... */
+    int word;  /* T_WORD: index into plan->words */
+    int start; /* offset of the token in the line */
+    int end;   /* offset just past it */
+};
+
+struct parser_t
+{                                    /* State while parsing a line */
+    struct plan_t *plan;             /* plan being built */
+    int ntokens;                     /* tokens in use */
+    int pos;                         /* next token to consume */
+    struct token_t tokens[MAXTOKENS];
+};
+
+struct event_t
+{               /* A job-state change waiting to be delivered */
+    int type;   /* EV_STARTED, EV_STOPPED, ... */
+    int jid;    /* job ID */
+    pid_t pid;  /* job PID */
+    int code;   /* exit status, signal number or job state */
+};
+struct event_t events[MAXEVENTS];    /* ring filled by postevent */
+volatile sig_atomic_t evhead = 0;    /* next slot to fill */
+volatile sig_atomic_t evtail = 0;    /* next slot to deliver */
+
+struct client_t
+{                      /* A control socket connection */
+    int fd;            /* socket, -1 if the slot is free */
+    int subscribed;    /* stream every event to this client */
+    int waiting;       /* JID whose exit we owe a reply for, 0 if none */
+    int len;           /* bytes buffered in buf */
+    char buf[MAXLINE]; /* partial request line */
+};
+char *ctl_path = NULL;               /* control socket path (-S) */
+int ctl_fd = -1;                     /* listening control socket */
+pid_t ctl_owner = 0;                 /* the shell pid, which owns ctl_path */
+struct client_t clients[MAXCLIENTS]; /* connected control clients */
+
+struct joblog_t
+{                     /* Captured output of a background job */
+    int fd;           /* read end of the job's pipe, -1 once drained */
+    int jid;          /* job ID the output belongs to */
+    pid_t pid;        /* job PID, 0 if the slot is free */
+    char *ring;       /* LOGSIZE bytes of output, oldest overwritten */
+    long long total;  /* bytes ever written to the ring */
+    unsigned int seq; /* allocation order, to retire the oldest first */
+    int tee;          /* show output as it arrives, even once reaped */
+};
+int capture = 0;               /* if true, capture background output (-c) */
+unsigned int logseq = 0;       /* next joblog_t sequence number */
+struct joblog_t logs[MAXLOGS]; /* captured job outputs */
+volatile sig_atomic_t interrupted = 0; /* ctrl-c with no foreground job */
+
+struct spawnreq_t
+{             /* Header of a spawn request to the zygote */
+    int argc; /* number of argv strings */
+    int envc; /* number of environment strings */
+};            /* followed by cwd, argv and envp as NUL-terminated strings */
+int zygote_fd = -1;    /* socket to the zygote, -1 if not running */
+pid_t zygote_pid = 0;  /* the zygote's pid */
+
+struct cachehdr_t
+{                  /* Header of a stored command result */
+    int magic;     /* CACHEMAGIC */
+    int status;    /* exit status of the run */
+    long long len; /* bytes of output that follow */
+};
+int caching = 0;                /* if true, the next launch is a cache miss */
+unsigned long cache_hits = 0;   /* runs replayed from the cache */
+unsigned long cache_misses = 0; /* runs that had to be started */
+unsigned long cache_stored = 0; /* misses whose result was kept */
+
+volatile sig_atomic_t watchsig[NSIG]; /* signals a watch job has to pass on */
+
+struct hist_t
+{                                      /* An HDR-style latency histogram */
+    unsigned long count;               /* values recorded */
+    long long max;                     /* largest value, in ns */
+    unsigned int buckets[HISTBUCKETS]; /* counts by value, to HISTSUB bits */
+};
+struct hist_t hist_spawn;        /* launch: fork or zygote round trip */
+struct hist_t hist_reap;         /* SIGCHLD handler entry to each reap */
+struct hist_t hist_fgwait;       /* foreground job reaped to waitfg return */
+struct hist_t hist_forward;      /* ctrl-c or ctrl-z to the job signalled */
+struct hist_t hist_lifetime;     /* job launched to job reaped */
+unsigned long stats_launched = 0;  /* jobs added to the job list */
+unsigned long stats_reaped = 0;    /* children that exited or were killed */
+unsigned long stats_tablefull = 0; /* jobs refused for want of a slot */
+unsigned long stats_coalesced = 0; /* children reaped by a SIGCHLD not their own */
 /* End global variables */
 
 /* Function prototypes */
@@ -58,7 +337,7 @@ struct job_t jobs[MAXJOBS]; /* The job list */
 void eval(char *cmdline);
 int builtin_cmd(char **argv);
 void do_bgfg(char **argv);
-void waitfg(pid_t pid);
+int waitfg(pid_t pid);
 
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
@@ -69,14 +348,138 @@ void sigint_handler(int sig);
 void safe_write(char *str, int size);
 void safe_write_int(int value);
 
+/* Simple builtins that run without a fork */
+void do_echo(char **argv);
+void do_cd(char **argv);
+void do_pwd(char **argv);
+void do_sleep(char **argv);
+void do_test(char **argv);
+
+/* pidfd helpers for race-free job addressing */
+int open_pidfd(pid_t pid);
+int signaljob(struct job_t *job, int sig);
+
+/* Event loop and control socket routines */
+void block_sigchld(sigset_t *prev);
+void restore_mask(sigset_t *prev);
+int readcmd(char *cmdline);
+int waitevent(int fd, int pidfd, struct timespec *timeout, sigset_t *prev);
+void postevent(int type, int jid, pid_t pid, int code);
+void flushevents(void);
+void ctl_open(char *path);
+void ctl_cleanup(void);
+void ctl_accept(void);
+void ctl_read(struct client_t *client);
+void ctl_request(struct client_t *client, char *req);
+void ctl_send(struct client_t *client, char *msg);
+void ctl_drop(struct client_t *client);
+char *jsonstr(char *dst, const char *src, size_t size);
+char *statename(int state);
+
+/* Zygote routines */
+void zygote_start(void);
+void zygote_main(int fd);
+void zygote_exec(char **argv, char **envp, char *cwd, int outfd);
+pid_t zygote_spawn(char **argv, int outfd);
+
+/* Result cache routines */
+void do_cached(struct plan_t *plan, int n, struct args_t *args);
+int cachedir(char *dir);
+int cachekey(char **argv, char *key);
+int cachereplay(char *key);
+void cachestore(char *key, char *data, long long len, int status);
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+void do_cache(char **argv);
+
+/* Watch routines */
+void do_watch(char **argv);
+pid_t watch_start(char **argv, int *pidfd);
+void watch_stop(pid_t pid, int pidfd, int sig);
+void watch_handler(int sig);
+
+/* Glob expansion routines */
+void freeargs(struct args_t *args);
+void addarg(struct args_t *args, char *word);
+char *savearg(struct args_t *args, const char *word, size_t len);
+void expandbraces(struct args_t *args, const char *word);
+void globword(struct args_t *args, const char *pat);
+void globwalk(struct args_t *args, char *path, int len, char **comps, int ncomps, int i, int found);
+int joinpath(char *path, int len, const char *name);
+int isglob(const char *s);
+int globmatch(const char *pat, const char *name);
+int classmatch(const char *p, int c, int *len);
+struct dirlist_t *readlisting(const char *path);
+int cmpword(const void *a, const void *b);
+
+/* Variable routines */
+int compilevars(char *dst, const char *src, int len, int *found);
+int varslot(const char *name, int len);
+void setvar(int slot, const char *value);
+const char *varvalue(int slot, char *buf);
+char *expandvars(struct args_t *args, const char *word);
+
+/* Statistics routines */
+long long nowns(void);
+void histadd(struct hist_t *h, long long ns);
+int histbucket(long long ns);
+long long histvalue(int b);
+long long histpct(struct hist_t *h, double pct);
+char *fmtns(long long ns, char *buf);
+void do_stats(char **argv);
+
+/* Output capture routines */
+void initlogs(void);
+struct joblog_t *newlog(void);
+struct joblog_t *findlog(char *arg);
+int drainlog(struct joblog_t *log);
+void do_logs(char **argv);
+
+/* Command list parsing and execution */
+struct plan_t *getplan(char *cmdline, struct plan_t *local);
+int parseline(const char *cmdline, struct plan_t *plan);
+int tokenize(struct parser_t *p, const char *cmdline);
+int parselist(struct parser_t *p);
+int parseandor(struct parser_t *p);
+int parsecommand(struct parser_t *p);
+int parseloop(struct parser_t *p);
+int iskeyword(struct parser_t *p, const char *word);
+int mknode(struct parser_t *p, int type, int left, int right);
+int syntaxerror(struct parser_t *p);
+int runnode(struct plan_t *plan, int n);
+pid_t launch(struct plan_t *plan, int n, int state, char *cmdline, int jid, struct args_t *args);
+void execcmd(char **argv);
+void entersubshell(sigset_t *prev);
+int waitchild(pid_t pid);
+int exitcode(int status);
+void buildargv(struct plan_t *plan, struct node_t *node, struct args_t *args);
+void buildwords(struct plan_t *plan, int first, int count, struct args_t *args);
+char *jobline(struct plan_t *plan, int n, char *buf);
+int hassubst(struct plan_t *plan, struct node_t *node);
+void procsubst(struct args_t *args, const char *cmd, int dir);
+
+/* Admission scheduler routines */
+int submitjob(struct plan_t *plan, int n, char *cmdline);
+int jobprio(struct plan_t *plan, int n);
+int cmdprefix(struct plan_t *plan, struct node_t *node, int *prio, int *cached);
+int prioclass(char *name);
+pid_t startqueued(struct job_t *job, int state);
+struct queued_t *savequeued(struct plan_t *plan, int n);
+void freequeued(struct queued_t *q);
+struct job_t *nextqueued(void);
+void admit(void);
+int overloaded(void);
+double readpsi(char *path);
+int readrunq(void);
+void do_sched(char **argv);
+
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv);
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
 void initjobs(struct job_t *jobs);
 int maxjid(struct job_t *jobs);
 int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
+int queuejob(struct job_t *jobs, int prio, char *cmdline);
 int deletejob(struct job_t *jobs, pid_t pid);
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
@@ -104,7 +507,7 @@ int main(int argc, char **argv)
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF)
+    while ((c = getopt(argc, argv, "hvpcS:")) != EOF)
     {
         switch (c)
         {
@@ -117,11 +520,20 @@ int main(int argc, char **argv)
         case 'p':            /* don't print a prompt */
             emit_prompt = 0; /* handy for automatic testing */
             break;
+        case 'c': /* capture background job output */
+            capture = 1;
+            break;
+        case 'S': /* serve the control socket at this path */
+            ctl_path = optarg;
+            break;
         default:
             usage();
         }
     }
 
+    /* Start the launcher before the shell's state grows */
+    zygote_start();
+
     /* Install the signal handlers */
 
     /* These are the ones you will need to implement */
@@ -134,6 +546,11 @@ int main(int argc, char **argv)
 
     /* Initialize the job list */
     initjobs(jobs);
+    initlogs();
+
+    /* Open the control socket if one was requested */
+    if (ctl_path != NULL)
+        ctl_open(ctl_path);
 
     /* Execute the shell's read/eval loop */
     while (1)
@@ -145,9 +562,7 @@ int main(int argc, char **argv)
             printf("%s", prompt);
             fflush(stdout);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin))
+        if (!readcmd(cmdline))
         { /* End of file (ctrl-d) */
             fflush(stdout);
             exit(0);
@@ -165,446 +580,4564 @@ int main(int argc, char **argv)
 /*
  * eval - Evaluate the command line that the user has just typed in
  *
- * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
- * the foreground, wait for it to terminate and then return.  Note:
- * each child process must have a unique process group ID so that our
- * background children don't receive SIGINT (SIGTSTP) from the kernel
- * when we type ctrl-c (ctrl-z) at the keyboard.
+ * The line is parsed into a plan of simple commands joined by ';',
+ * '&&', '||' and '&', with '(...)' grouping and for and while loops,
+ * and the plan is run right here. Plans are kept by line text, so a
+ * line that comes round again is not parsed again. If the user has
+ * requested a built-in command (quit, jobs, bg or fg) then execute it
+ * immediately. Otherwise, fork a child process and run the job in the
+ * context of the child. If the job is running in the foreground, wait
+ * for it to terminate and then carry on with the rest of the line.
+ * Note: each child process must have a unique process group ID so
+ * that our background children don't receive SIGINT (SIGTSTP) from
+ * the kernel when we type ctrl-c (ctrl-z) at the keyboard.
  */
 void eval(char *cmdline)
 {
     // set up local variables
-    char *argv[MAXARGS];
-    int bg;
-    pid_t pid;
-    sigset_t mask;
+    struct plan_t local, *plan;
+
+    // find or parse the plan for this line
+    if ((plan = getplan(cmdline, &local)) == NULL)
+    {
+        laststatus = 2;
+        return;
+    }
 
-    // parse input and get bg indicator
-    bg = parseline(cmdline, argv);
-    if (argv[0] == NULL)
+    // ignore blank lines
+    if (plan->root < 0)
     {
         return;
     }
 
-    // builtin cmd check
-    if (!builtin_cmd(argv))
+    // run the whole line; the plan can't be recycled meanwhile
+    plan->busy++;
+    runnode(plan, plan->root);
+    plan->busy--;
+}
+
+/*
+ * getplan - Return the plan for a command line, from the plan cache
+ *     if the line has been parsed before. A new plan replaces the
+ *     least recently used one that isn't running; if they all are,
+ *     the line is parsed into local. Returns NULL on a syntax error,
+ *     which is not cached.
+ */
+struct plan_t *getplan(char *cmdline, struct plan_t *local)
+{
+    struct planent_t *ent, *victim = NULL;
+    struct plan_t *plan;
+    long long start;
+    uint64_t hash;
+    size_t len;
+    int i;
+
+    // look the line up
+    len = strlen(cmdline);
+    hash = xxh64(cmdline, len, 0) | 1;
+    for (i = 0; i < MAXPLANS; i++)
+    {
+        ent = &plancache[i];
+        if (ent->hash == hash && strcmp(ent->line, cmdline) == 0)
+        {
+            ent->seq = planseq++;
+            plan_hits++;
+            if (verbose)
+                printf("Reused plan for line (%lu hits)\n", plan_hits);
+            return &ent->plan;
+        }
+        if (ent->plan.busy == 0 && (victim == NULL || ent->hash == 0 ||
+                                    (victim->hash != 0 && ent->seq < victim->seq)))
+        {
+            victim = ent;
+        }
+    }
+
+    // parse it into the oldest free slot
+    plan = local;
+    if (victim != NULL && len < MAXLINE)
+    {
+        victim->hash = 0;
+        memcpy(victim->line, cmdline, len + 1);
+        cmdline = victim->line;
+        plan = &victim->plan;
+    }
+    start = nowns();
+    if (parseline(cmdline, plan) < 0)
+        return NULL;
+    start = nowns() - start;
+    plan_misses++;
+    parse_ns += start;
+    if (verbose)
+        printf("Parsed line in %lld ns\n", start);
+    if (plan != local)
+    {
+        victim->hash = hash;
+        victim->seq = planseq++;
+    }
+    return plan;
+}
+
+/*
+ * runnode - Run node n of a plan and return its exit status, which is
+ *     also left in laststatus. In the shell, commands become jobs; in
+ *     a subshell they are plain children of the subshell, which is
+ *     itself the job.
+ */
+int runnode(struct plan_t *plan, int n)
+{
+    // set up local variables
+    struct node_t *node = &plan->nodes[n];
+    struct args_t args;
+    char **argv;
+    char cmdline[MAXLINE + 3];
+    struct job_t *job;
+    sigset_t prev;
+    pid_t pid;
+    int status, prio, cached, i;
+
+    switch (node->type)
     {
-        // set up a signal block for SIGCHLD
-        if (sigemptyset(&mask) != 0)
+    case N_CMD:
+        cancelled = 0;
+
+        // process substitutions need a subshell to run them and wait
+        if (!subshell && hassubst(plan, node))
+        {
+            pid = launch(plan, n, FG, jobline(plan, n, cmdline), 0, NULL);
+            laststatus = waitfg(pid);
+            break;
+        }
+
+        // expand the words, which may have to look at the filesystem
+        buildargv(plan, node, &args);
+        argv = args.argv;
+        laststatus = 0;
+
+        // a cached external command may not need to run at all
+        cmdprefix(plan, node, &prio, &cached);
+        if (cached && strchr(argv[0], '/') != NULL)
+        {
+            do_cached(plan, n, &args);
+        }
+        // builtin cmd check; in the shell, watch needs a job of its own,
+        // and so does sleep, so that ctrl-z can stop it
+        else if ((subshell || (strcmp(argv[0], "watch") != 0 && strcmp(argv[0], "sleep") != 0)) &&
+                 builtin_cmd(argv))
         {
-            unix_error("sigemptyset error");
         }
-        if (sigaddset(&mask, SIGCHLD) != 0)
+        else if (subshell)
         {
-            unix_error("sigaddset error");
+            // run the command as a child of the subshell
+            fflush(stdout);
+            if ((pid = fork()) == 0)
+            {
+                execcmd(argv);
+            }
+            laststatus = waitchild(pid);
         }
-        if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0)
+        else
         {
-            unix_error("sigprocmask blocking error");
+            // run the command as a foreground job
+            pid = launch(plan, n, FG, jobline(plan, n, cmdline), 0, &args);
+            laststatus = waitfg(pid);
         }
+        freeargs(&args);
+        break;
 
-        // fork the child process
-        if ((pid = fork()) == 0)
+    case N_BG:
+        cancelled = 0;
+        if (subshell)
+        {
+            // the subshell is the job, so just don't wait
+            fflush(stdout);
+            if ((pid = fork()) == 0)
+            {
+                exit(runnode(plan, node->left));
+            }
+            laststatus = 0;
+            break;
+        }
+        // start or queue the background job and print a confirmation;
+        // a quick job can't be reaped before we have looked it up
+        block_sigchld(&prev);
+        job = getjobjid(jobs, submitjob(plan, node->left, jobline(plan, n, cmdline)));
+        if (job != NULL && job->state == QU)
+        {
+            printf("[%d] (queued) %s", job->jid, job->cmdline);
+        }
+        else if (job != NULL)
         {
-            // child process sets a new group id for itself
-            setpgid(0, 0);
+            printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+        }
+        restore_mask(&prev);
+        laststatus = 0;
+        break;
 
-            // Execute the command
-            if (execve(argv[0], argv, environ) < 0)
+    case N_GROUP:
+        if (subshell)
+        {
+            // a nested group is one more child subshell
+            fflush(stdout);
+            if ((pid = fork()) == 0)
             {
-                printf("%s: Command not found\n", argv[0]);
-                exit(1);
+                exit(runnode(plan, node->left));
             }
+            laststatus = waitchild(pid);
+            break;
         }
+        // the whole group runs as one foreground job
+        pid = launch(plan, n, FG, jobline(plan, n, cmdline), 0, NULL);
+        laststatus = waitfg(pid);
+        break;
 
-        // add the job to the job list
-        addjob(jobs, pid, bg ? BG : FG, cmdline);
+    case N_SEQ:
+        // a ctrl-c that ended the left side abandons the rest
+        runnode(plan, node->left);
+        if (!cancelled)
+        {
+            runnode(plan, node->right);
+        }
+        break;
 
-        // unblock SIGCHLD after the job is added
-        if (sigprocmask(SIG_UNBLOCK, &mask, NULL) != 0)
+    case N_AND:
+        if (runnode(plan, node->left) == 0)
         {
-            unix_error("sigprocmask unblocking error");
+            runnode(plan, node->right);
         }
+        break;
 
-        // deal with background vs foreground
-        if (!bg)
+    case N_OR:
+        if (runnode(plan, node->left) != 0 && !cancelled)
         {
-            // wait for the job to finish in foreground
-            waitfg(pid);
+            runnode(plan, node->right);
         }
-        else
+        break;
+
+    case N_FOR:
+        // the words are expanded once, then bound in turn
+        memset(&args, 0, sizeof(args));
+        buildwords(plan, node->argv, node->argc, &args);
+        interrupted = 0;
+        status = 0;
+        for (i = 0; i < args.argc; i++)
+        {
+            setvar(node->right, args.argv[i]);
+            status = runnode(plan, node->left);
+            if (cancelled || interrupted)
+                break;
+        }
+        freeargs(&args);
+
+        // a loop cut short by ctrl-c was itself interrupted, even if
+        // only builtins were running
+        if (cancelled || interrupted)
         {
-            // print a confirmation for background job
-            printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline);
+            status = 128 + SIGINT;
+            cancelled = 1;
         }
+        laststatus = status;
+        break;
+
+    case N_WHILE:
+        // ctrl-c in the condition or the body ends the loop
+        interrupted = 0;
+        status = 0;
+        while (runnode(plan, node->left) == 0 && !cancelled && !interrupted)
+        {
+            status = runnode(plan, node->right);
+            if (cancelled || interrupted)
+                break;
+        }
+        if (cancelled || interrupted)
+        {
+            status = 128 + SIGINT;
+            cancelled = 1;
+        }
+        laststatus = status;
+        break;
     }
+
+    return laststatus;
 }
 
 /*
- * parseline - Parse the command line and build the argv array.
- *
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.
+ * launch - Fork a child for node n of a plan in its own process group
+ *     and add it to the job list in the given state. A simple command
+ *     is exec'd; anything else runs in the child as a subshell, so the
+ *     whole list is one job. SIGCHLD is blocked until the job is added
+ *     so the handler can't reap it first. With -c, a background job's
+ *     stdout and stderr go to a pipe that the event loop drains into
+ *     the job's log. A queued job being started passes its jid to keep
+ *     it; otherwise jid is 0. A command with process substitutions
+ *     runs as a subshell, which starts and reaps the inner commands in
+ *     the job's process group. A cached command runs as a subshell
+ *     that consults the cache, unless this launch is the cache miss
+ *     itself, which is captured and shown as it runs. A simple command
+ *     whose words the caller has already expanded passes them in
+ *     args; otherwise args is NULL. Returns the child's pid.
  */
-int parseline(const char *cmdline, char **argv)
+pid_t launch(struct plan_t *plan, int n, int state, char *cmdline, int jid, struct args_t *args)
 {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
-    int bg;                     /* background job? */
+    // set up local variables
+    pid_t pid;
+    sigset_t prev;
+    struct joblog_t *log = NULL;
+    struct args_t own;
+    char **argv = NULL;
+    int fds[2], simple, prio, cached;
+    long long start;
 
-    strcpy(buf, cmdline);
-    buf[strlen(buf) - 1] = ' ';   /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-        buf++;
+    // set up a signal block for SIGCHLD
+    block_sigchld(&prev);
 
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'')
+    // decide whether the command can be exec'd directly
+    simple = (plan->nodes[n].type == N_CMD && !hassubst(plan, &plan->nodes[n]));
+    if (simple)
     {
-        buf++;
-        delim = strchr(buf, '\'');
+        if (args == NULL)
+        {
+            buildargv(plan, &plan->nodes[n], &own);
+            args = &own;
+        }
+        argv = args->argv;
+        cmdprefix(plan, &plan->nodes[n], &prio, &cached);
+        simple = caching || !(cached && strchr(argv[0], '/') != NULL);
     }
-    else
+
+    // set up the capture pipe; without a free log the job just
+    // writes to the terminal as usual
+    if (((capture && state == BG) || caching) && (log = newlog()) != NULL)
     {
-        delim = strchr(buf, ' ');
+        if (pipe2(fds, O_CLOEXEC) < 0)
+        {
+            unix_error("pipe error");
+        }
     }
 
-    while (delim)
+    // don't let the child inherit output we haven't written yet
+    fflush(stdout);
+
+    // external commands (always given as paths) are spawned by the
+    // zygote, so the cost doesn't grow with the shell; otherwise fork
+    start = nowns();
+    pid = -1;
+    if (simple && strchr(argv[0], '/') != NULL)
+    {
+        pid = zygote_spawn(argv, log != NULL ? fds[1] : -1);
+    }
+    if (pid < 0 && (pid = fork()) == 0)
     {
-        argv[argc++] = buf;
-        *delim = '\0';
-        buf = delim + 1;
-        while (*buf && (*buf == ' ')) /* ignore spaces */
-            buf++;
-        if (*buf == '\'')
+        // child process sets a new group id for itself
+        setpgid(0, 0);
+
+        // a queued job starts where it was submitted
+        if (launchdir >= 0 && fchdir(launchdir) < 0)
         {
-            buf++;
-            delim = strchr(buf, '\'');
+            unix_error("fchdir error");
         }
-        else
+
+        // send output into the capture pipe
+        if (log != NULL)
+        {
+            dup2(fds[1], STDOUT_FILENO);
+            dup2(fds[1], STDERR_FILENO);
+        }
+
+        // the job is this child now, so ctrl-c and ctrl-z act on it
+        entersubshell(&prev);
+
+        // Execute the command; a builtin run as a job runs right here
+        if (simple)
         {
-            delim = strchr(buf, ' ');
+            if (builtin_cmd(argv))
+            {
+                exit(laststatus);
+            }
+            execcmd(argv);
         }
+
+        // or run the list as a subshell
+        exit(runnode(plan, plan->nodes[n].type == N_GROUP ? plan->nodes[n].left : n));
     }
 
-    argv[argc] = NULL;
+    histadd(&hist_spawn, nowns() - start);
 
-    if (argc == 0) /* ignore blank line */
-        return 1;
+    // set the group from this side too, so the job can be signalled
+    // before the child has gotten around to it
+    setpgid(pid, pid);
+
+    // add the job to the job list and tell any subscribers; a queued
+    // job's jid was freed just before, so it can be handed out again
+    if (jid > 0)
+    {
+        nextjid = jid;
+    }
+    if (addjob(jobs, pid, state, cmdline))
+    {
+        stats_launched++;
+        postevent(EV_STARTED, pid2jid(pid), pid, state);
+    }
+    if (jid > 0)
+    {
+        nextjid = maxjid(jobs) + 1;
+    }
 
-    /* should the job run in the background? */
-    if ((bg = (*argv[argc - 1] == '&')) != 0)
+    // hand the read end to the event loop
+    if (log != NULL)
+    {
+        close(fds[1]);
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        log->fd = fds[0];
+        log->jid = pid2jid(pid);
+        log->pid = pid;
+        log->tee = caching;
+    }
+    caching = 0;
+    if (args == &own)
     {
-        argv[--argc] = NULL;
+        freeargs(&own);
     }
 
-    return bg;
+    // restore the signal mask after the job is added
+    restore_mask(&prev);
+
+    return pid;
 }
 
 /*
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.
+ * execcmd - Exec argv in the current (child) process
  */
-int builtin_cmd(char **argv)
+void execcmd(char **argv)
 {
-    if (strcmp(argv[0], "quit") == 0)
+    if (execve(argv[0], argv, environ) < 0)
     {
-        // exit the terminal
-        exit(0);
+        printf("%s: Command not found\n", argv[0]);
+        exit(1);
     }
-    else if (strcmp(argv[0], "jobs") == 0)
+}
+
+/*
+ * entersubshell - Turn a freshly forked child into a subshell that
+ *     runs the rest of a list. It is the job, so ctrl-c and ctrl-z
+ *     act on it directly, and it reaps its own children.
+ */
+void entersubshell(sigset_t *prev)
+{
+    int i;
+
+    subshell = 1;
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTSTP, SIG_DFL);
+    Signal(SIGCHLD, SIG_DFL);
+    restore_mask(prev);
+
+    // children of the zygote would belong to the shell, not to us
+    if (zygote_fd >= 0)
     {
-        // list the jobs
-        listjobs(jobs);
+        close(zygote_fd);
+        zygote_fd = -1;
     }
-    else if (strcmp(argv[0], "bg") == 0 || strcmp(argv[0], "fg") == 0)
+
+    // the control socket and capture pipes belong to the shell
+    if (ctl_fd >= 0)
     {
-        // hand off to do_bgfg
-        do_bgfg(argv);
+        close(ctl_fd);
+        for (i = 0; i < MAXCLIENTS; i++)
+            if (clients[i].fd >= 0)
+                close(clients[i].fd);
+        ctl_fd = -1;
     }
-    else
+    for (i = 0; i < MAXLOGS; i++)
     {
-        // Not a builtin command
-        return 0;
+        if (logs[i].fd >= 0)
+            close(logs[i].fd);
+        logs[i].fd = -1;
     }
+    capture = 0;
 
-    // Was a builtin command
-    return 1;
+    // queued jobs are the shell's to start, not ours as well
+    for (i = 0; i < MAXJOBS; i++)
+    {
+        if (jobs[i].state == QU)
+        {
+            freequeued(jobs[i].queued);
+            clearjob(&jobs[i]);
+        }
+    }
 }
 
 /*
- * do_bgfg - Execute the builtin bg and fg commands
+ * waitchild - Wait for a child of a subshell and return its status
  */
-void do_bgfg(char **argv)
+int waitchild(pid_t pid)
 {
-    // set up the local variables
-    int jid;
-    pid_t pid;
-    struct job_t *job;
+    int status;
 
-    // confirm whether there is a second argument
-    if (argv[1] == NULL)
+    cancelled = 0;
+    while (waitpid(pid, &status, 0) < 0)
     {
-        // print error for not having a second argument and return
-        printf("%s command requires PID or %cjobid argument\n", argv[0], '%');
-        return;
+        if (errno != EINTR)
+            return 127;
     }
-    else
-    {
-        // check if the second arg is a job
-        if (argv[1][0] == '%')
-        {
-            // get the job number and job
-            jid = atoi(argv[1] + 1);
-            job = getjobjid(jobs, jid);
+    cancelled = WIFSIGNALED(status) && WTERMSIG(status) == SIGINT;
+    return exitcode(status);
+}
 
-            // check that the job exists
-            if (job == NULL)
-            {
-                printf("%s: No such job\n", argv[1]);
-                return;
-            }
-        }
-        // check for a process id number
-        else if ((pid = atoi(argv[1])) > 0)
-        {
-            // get the job based on the process id
-            job = getjobpid(jobs, pid);
+/*
+ * exitcode - Convert a wait status into a shell exit status
+ */
+int exitcode(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status))
+        return 128 + WSTOPSIG(status);
+    return 0;
+}
 
-            // check that the job exists
-            if (job == NULL)
-            {
-                printf("(%s): No such process\n", argv[1]);
-                return;
-            }
-        }
-        else
-        {
-            // print error for not being a job id or pid and return
-            printf("%s: argument must be a PID or %cjobid\n", argv[0], '%');
-            return;
-        }
+/*
+ * buildargv - Fill args with the words of a simple command, expanding
+ *     variables, then braces and glob patterns against the filesystem
+ *     as it is now. In a subshell, process substitutions are started
+ *     and replaced by their /dev/fd paths. The caller releases them
+ *     with freeargs, which also waits for the substitutions.
+ */
+void buildargv(struct plan_t *plan, struct node_t *node, struct args_t *args)
+{
+    int skip, prio, cached;
 
-        // check if the process is moving to the background or foreground
-        if (strcmp(argv[0], "bg") == 0)
-        {
-            // send the continue signal to the process
-            if (kill(-(job->pid), SIGCONT) == 0)
-            {
-                // change the job state to background
-                job->state = BG;
+    memset(args, 0, sizeof(*args));
 
-                // print a confirmation that the job is running
-                printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
-            }
-            else
+    // "prio <class>" and "cached" prefixes are only for the shell
+    skip = cmdprefix(plan, node, &prio, &cached);
+    buildwords(plan, node->argv + skip, node->argc - skip, args);
+}
+
+/*
+ * buildwords - Expand count words of a plan, starting at first, onto
+ *     the end of args. A variable's value is one word, which is only
+ *     treated as a pattern if it contains one.
+ */
+void buildwords(struct plan_t *plan, int first, int count, struct args_t *args)
+{
+    char *word;
+    int i;
+
+    for (i = first; i < first + count; i++)
+    {
+        word = plan->buf + plan->words[i];
+        if (plan->vars[i])
+            word = expandvars(args, word);
+        if (plan->substs[i] && subshell)
+            procsubst(args, word, plan->substs[i]);
+        else if (plan->globs[i] || (plan->vars[i] && (isglob(word) || strchr(word, '{') != NULL)))
+            expandbraces(args, word);
+        else
+            addarg(args, word);
+    }
+}
+
+/*
+ * jobline - Build the command line shown for a job started from node
+ *     n. A job that is the whole line keeps the line exactly as typed.
+ *     Returns buf.
+ */
+char *jobline(struct plan_t *plan, int n, char *buf)
+{
+    struct node_t *root = &plan->nodes[plan->root];
+    struct node_t *node = &plan->nodes[n];
+
+    if (n == plan->root || (root->type == N_BG && root->left == n))
+    {
+        snprintf(buf, MAXLINE, "%s", plan->line);
+    }
+    else
+    {
+        snprintf(buf, MAXLINE + 3, "%.*s\n", node->end - node->start,
+                 plan->line + node->start);
+    }
+    return buf;
+}
+
+/*
+ * hassubst - Return true if a simple command has a process
+ *     substitution among its words
+ */
+int hassubst(struct plan_t *plan, struct node_t *node)
+{
+    int i;
+
+    for (i = node->argv; node->type == N_CMD && i < node->argv + node->argc; i++)
+        if (plan->substs[i])
+            return 1;
+    return 0;
+}
+
+/*
+ * procsubst - Start cmd for a process substitution and add the path
+ *     of our end of its pipe to args: its output for '<', its input
+ *     for '>'. It is a child of this subshell, so it shares the job's
+ *     process group, and freeargs reaps it.
+ */
+void procsubst(struct args_t *args, const char *cmd, int dir)
+{
+    struct plan_t plan;
+    char path[32];
+    int fds[2], i;
+    pid_t pid;
+
+    if (args->nsubs == MAXSUBSTS || pipe(fds) < 0)
+    {
+        printf("%c(%s): too many process substitutions\n", dir, cmd);
+        addarg(args, savearg(args, "/dev/null", 9));
+        return;
+    }
+
+    fflush(stdout);
+    if ((pid = fork()) == 0)
+    {
+        // keep only our own pipe, so the others see end of file
+        dup2(dir == '<' ? fds[1] : fds[0], dir == '<' ? STDOUT_FILENO : STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        for (i = 0; i < args->nsubs; i++)
+            close(args->subfds[i]);
+        if (parseline(cmd, &plan) < 0)
+            exit(2);
+        exit(plan.root < 0 ? 0 : runnode(&plan, plan.root));
+    }
+
+    // the command being built keeps the other end across exec
+    close(dir == '<' ? fds[1] : fds[0]);
+    args->subfds[args->nsubs] = (dir == '<') ? fds[0] : fds[1];
+    args->subs[args->nsubs++] = pid;
+    snprintf(path, sizeof(path), "/dev/fd/%d", args->subfds[args->nsubs - 1]);
+    addarg(args, savearg(args, path, strlen(path)));
+}
+
+/*
+ * parseline - Parse the command line and build the plan.
+ *
+ * Words are separated by spaces, and the operators ';', '&', '&&',
+ * '||', '(' and ')' need no spaces around them. Characters enclosed
+ * in single quotes are treated as a single argument. Other words
+ * with *, ?, [...] or {a,b} are noted as patterns, which are expanded
+ * when the command runs, and <(cmd) or >(cmd) is a process
+ * substitution. $name, ${name} and $? in other words are compiled to
+ * variable slots, which are looked up when the command runs. The
+ * words for, while, do and done in command position make loops. A
+ * line may not contain the VARMARK byte itself.
+ * Return 0 on success, with plan->root set to -1 for a blank line,
+ * or -1 after printing a syntax error.
+ */
+int parseline(const char *cmdline, struct plan_t *plan)
+{
+    struct parser_t p;
+
+    plan->line = cmdline;
+    plan->nnodes = 0;
+    plan->nwords = 0;
+    plan->len = 0;
+    plan->busy = 0;
+    p.plan = plan;
+    p.ntokens = 0;
+    p.pos = 0;
+
+    // VARMARK is how compiled words refer to variables
+    if (strchr(cmdline, VARMARK) != NULL)
+    {
+        printf("syntax error: control character \\%03o in line\n", VARMARK);
+        return -1;
+    }
+
+    if (tokenize(&p, cmdline) < 0)
+        return -1;
+    if ((plan->root = parselist(&p)) == -2)
+        return -1;
+    if (p.tokens[p.pos].type != T_END)
+        return syntaxerror(&p);
+    return 0;
+}
+
+/*
+ * tokenize - Split a command line into words and operators
+ */
+int tokenize(struct parser_t *p, const char *cmdline)
+{
+    struct plan_t *plan = p->plan;
+    struct token_t *tok;
+    const char *s = cmdline;
+    const char *end;
+    int depth, n, found;
+
+    while (1)
+    {
+        while (*s == ' ' || *s == '\t') /* ignore spaces */
+            s++;
+        if (p->ntokens == MAXTOKENS - 1)
+        {
+            printf("too many words\n");
+            return -1;
+        }
+        tok = &p->tokens[p->ntokens++];
+        tok->start = s - cmdline;
+        if (*s == '\0' || *s == '\n')
+        {
+            tok->type = T_END;
+            tok->end = tok->start;
+            return 0;
+        }
+
+        // operators
+        if ((s[0] == '&' && s[1] == '&') || (s[0] == '|' && s[1] == '|'))
+        {
+            tok->type = (s[0] == '&') ? T_AND : T_OR;
+            s += 2;
+        }
+        else if (*s == '&' || *s == ';' || *s == '(' || *s == ')')
+        {
+            tok->type = (*s == '&') ? T_AMP : (*s == ';') ? T_SEMI :
+                        (*s == '(') ? T_LPAREN : T_RPAREN;
+            s++;
+        }
+        else
+        {
+            // a word, either quoted or running to the next separator
+            if (plan->nwords == MAXARGS)
+            {
+                printf("too many words\n");
+                return -1;
+            }
+            tok->type = T_WORD;
+            tok->word = plan->nwords;
+            plan->globs[plan->nwords] = 0;
+            plan->substs[plan->nwords] = 0;
+            plan->vars[plan->nwords] = 0;
+            plan->words[plan->nwords++] = plan->len;
+            if ((*s == '<' || *s == '>') && s[1] == '(')
+            {
+                // a process substitution runs to the matching ')'
+                for (depth = 0, end = s + 1; *end != '\0'; end++)
+                {
+                    if (*end == '\'' && strchr(end + 1, '\'') != NULL)
+                        end = strchr(end + 1, '\'');
+                    else if (*end == '(')
+                        depth++;
+                    else if (*end == ')' && --depth == 0)
+                        break;
+                }
+                if (*end != ')')
+                {
+                    printf("syntax error: missing ')' after %c(\n", *s);
+                    return -1;
+                }
+                plan->substs[tok->word] = *s;
+                memcpy(plan->buf + plan->len, s + 2, end - s - 2);
+                plan->len += end - s - 2;
+                s = end + 1;
+            }
+            else if (*s == '\'')
+            {
+                if ((end = strchr(s + 1, '\'')) == NULL)
+                    end = s + strlen(s);
+                memcpy(plan->buf + plan->len, s + 1, end - s - 1);
+                plan->len += end - s - 1;
+                s = (*end == '\'') ? end + 1 : end;
+            }
+            else
+            {
+                // a lone '|' is just part of the word
+                end = s + strcspn(s, " \t\n&;|()");
+                while (*end == '|' && end[1] != '|')
+                    end += 1 + strcspn(end + 1, " \t\n&;|()");
+                n = compilevars(plan->buf + plan->len, s, end - s, &found);
+                plan->vars[tok->word] = found;
+                plan->globs[tok->word] = isglob(plan->buf + plan->len) ||
+                                         strchr(plan->buf + plan->len, '{') != NULL;
+                plan->len += n;
+                s = end;
+            }
+            plan->buf[plan->len++] = '\0';
+        }
+        tok->end = s - cmdline;
+    }
+}
+
+/*
+ * parselist - Parse and-or lists separated by ';' or '&', up to the
+ *     end of the line, a ')', or a do or done. Returns the node, -1
+ *     for an empty list, or -2 on a syntax error.
+ */
+int parselist(struct parser_t *p)
+{
+    int list = -1, item, type;
+    struct token_t *tok;
+
+    while ((type = p->tokens[p->pos].type) != T_END && type != T_RPAREN &&
+           !iskeyword(p, "do") && !iskeyword(p, "done"))
+    {
+        if ((item = parseandor(p)) < 0)
+            return -2;
+
+        // a trailing '&' sends the whole and-or list to the background
+        tok = &p->tokens[p->pos];
+        if (tok->type == T_AMP)
+        {
+            if ((item = mknode(p, N_BG, item, -1)) < 0)
+                return -2;
+            p->plan->nodes[item].end = tok->end;
+            p->pos++;
+        }
+        else if (tok->type == T_SEMI)
+        {
+            p->pos++;
+        }
+        else if (tok->type != T_END && tok->type != T_RPAREN)
+        {
+            syntaxerror(p);
+            return -2;
+        }
+
+        if (list >= 0 && (item = mknode(p, N_SEQ, list, item)) < 0)
+            return -2;
+        list = item;
+    }
+    return list;
+}
+
+/*
+ * parseandor - Parse commands joined by '&&' and '||'. Returns the
+ *     node or -1 on a syntax error.
+ */
+int parseandor(struct parser_t *p)
+{
+    int left, right, type;
+
+    if ((left = parsecommand(p)) < 0)
+        return -1;
+    while ((type = p->tokens[p->pos].type) == T_AND || type == T_OR)
+    {
+        p->pos++;
+        if ((right = parsecommand(p)) < 0)
+            return -1;
+        if ((left = mknode(p, type == T_AND ? N_AND : N_OR, left, right)) < 0)
+            return -1;
+    }
+    return left;
+}
+
+/*
+ * parsecommand - Parse a simple command, a '(' list ')' group or a
+ *     loop. Returns the node or -1 on a syntax error.
+ */
+int parsecommand(struct parser_t *p)
+{
+    struct token_t *tok = &p->tokens[p->pos];
+    struct node_t *node;
+    int inner, n;
+
+    if (tok->type == T_LPAREN)
+    {
+        p->pos++;
+        if ((inner = parselist(p)) == -2)
+            return -1;
+        if (inner == -1 || p->tokens[p->pos].type != T_RPAREN)
+            return syntaxerror(p);
+        if ((n = mknode(p, N_GROUP, inner, -1)) < 0)
+            return -1;
+        p->plan->nodes[n].start = tok->start;
+        p->plan->nodes[n].end = p->tokens[p->pos++].end;
+        return n;
+    }
+    if (tok->type != T_WORD)
+        return syntaxerror(p);
+    if (iskeyword(p, "for") || iskeyword(p, "while"))
+        return parseloop(p);
+
+    // a run of words is one simple command
+    if ((n = mknode(p, N_CMD, -1, -1)) < 0)
+        return -1;
+    node = &p->plan->nodes[n];
+    node->argv = tok->word;
+    node->argc = 0;
+    node->start = tok->start;
+    while (p->tokens[p->pos].type == T_WORD)
+    {
+        node->end = p->tokens[p->pos++].end;
+        node->argc++;
+    }
+    return n;
+}
+
+/*
+ * parseloop - Parse "for name [in words] ; do list ; done" or
+ *     "while list ; do list ; done". The loop variable gets its slot
+ *     here, like a $name in a word. Returns the node or -1 on a
+ *     syntax error.
+ */
+int parseloop(struct parser_t *p)
+{
+    struct plan_t *plan = p->plan;
+    struct token_t *first = &p->tokens[p->pos++];
+    struct token_t *tok;
+    int type, slot = 0, argv = 0, argc = 0, cond = -1, body, n;
+    char *name;
+
+    if (strcmp(plan->buf + plan->words[first->word], "for") == 0)
+    {
+        // the variable, then the words up to the ';'
+        type = N_FOR;
+        tok = &p->tokens[p->pos];
+        if (tok->type != T_WORD)
+            return syntaxerror(p);
+        name = plan->buf + plan->words[tok->word];
+        if (plan->vars[tok->word] || strcmp(name, "?") == 0 ||
+            (slot = varslot(name, strlen(name))) < 0)
+        {
+            printf("for: '%s': not a valid name\n", name);
+            return -1;
+        }
+        p->pos++;
+        if (iskeyword(p, "in"))
+        {
+            for (p->pos++; p->tokens[p->pos].type == T_WORD; p->pos++)
+                if (argc++ == 0)
+                    argv = p->tokens[p->pos].word;
+        }
+    }
+    else
+    {
+        // the condition runs to the do
+        type = N_WHILE;
+        if ((cond = parselist(p)) == -2)
+            return -1;
+        if (cond == -1)
+            return syntaxerror(p);
+    }
+
+    // a for's words must end with a ';'; a while's list already ate it
+    if (type == N_FOR)
+    {
+        if (p->tokens[p->pos].type != T_SEMI)
+            return syntaxerror(p);
+        p->pos++;
+    }
+    if (!iskeyword(p, "do"))
+        return syntaxerror(p);
+    p->pos++;
+    if ((body = parselist(p)) == -2)
+        return -1;
+    if (body == -1 || !iskeyword(p, "done"))
+        return syntaxerror(p);
+
+    if (type == N_FOR)
+    {
+        if ((n = mknode(p, N_FOR, body, -1)) < 0)
+            return -1;
+        plan->nodes[n].right = slot;
+        plan->nodes[n].argv = argv;
+        plan->nodes[n].argc = argc;
+    }
+    else if ((n = mknode(p, N_WHILE, cond, body)) < 0)
+    {
+        return -1;
+    }
+    plan->nodes[n].start = first->start;
+    plan->nodes[n].end = p->tokens[p->pos++].end;
+    return n;
+}
+
+/*
+ * iskeyword - Return true if the next token is the given word, typed
+ *     without quotes
+ */
+int iskeyword(struct parser_t *p, const char *word)
+{
+    struct token_t *tok = &p->tokens[p->pos];
+    struct plan_t *plan = p->plan;
+
+    return tok->type == T_WORD && !plan->globs[tok->word] && !plan->vars[tok->word] &&
+           !plan->substs[tok->word] && strcmp(plan->buf + plan->words[tok->word], word) == 0 &&
+           plan->line[tok->start] != '\'';
+}
+
+/*
+ * mknode - Add a node to the plan, spanning its operands' text.
+ *     Returns the node or -1 if the plan is full.
+ */
+int mknode(struct parser_t *p, int type, int left, int right)
+{
+    struct plan_t *plan = p->plan;
+    struct node_t *node;
+
+    if (plan->nnodes == MAXNODES)
+    {
+        printf("too many commands\n");
+        return -1;
+    }
+    node = &plan->nodes[plan->nnodes];
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    if (left >= 0)
+    {
+        node->start = plan->nodes[left].start;
+        node->end = plan->nodes[right >= 0 ? right : left].end;
+    }
+    return plan->nnodes++;
+}
+
+/*
+ * syntaxerror - Complain about the current token. Returns -1.
+ */
+int syntaxerror(struct parser_t *p)
+{
+    struct token_t *tok = &p->tokens[p->pos];
+
+    if (tok->type == T_END)
+        printf("syntax error near unexpected newline\n");
+    else
+        printf("syntax error near unexpected token '%.*s'\n",
+               tok->end - tok->start, p->plan->line + tok->start);
+    return -1;
+}
+
+/*
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately. Besides job control, the common utilities echo,
+ *    true, false, sleep, test, [, cd and pwd run without a fork; when
+ *    backgrounded they run in the forked job instead, and so does a
+ *    foreground sleep, which has to be a job to be stopped. Builtins
+ *    leave their exit status in laststatus.
+ */
+int builtin_cmd(char **argv)
+{
+    if (strcmp(argv[0], "quit") == 0)
+    {
+        // exit the terminal
+        exit(0);
+    }
+    else if (strcmp(argv[0], "jobs") == 0)
+    {
+        // list the jobs
+        listjobs(jobs);
+    }
+    else if (strcmp(argv[0], "bg") == 0 || strcmp(argv[0], "fg") == 0)
+    {
+        // hand off to do_bgfg
+        do_bgfg(argv);
+    }
+    else if (strcmp(argv[0], "sched") == 0)
+    {
+        // configure background job admission
+        do_sched(argv);
+    }
+    else if (strcmp(argv[0], "logs") == 0)
+    {
+        // replay or follow a job's captured output
+        do_logs(argv);
+    }
+    else if (strcmp(argv[0], "cache") == 0)
+    {
+        // report on or prune the result cache
+        do_cache(argv);
+    }
+    else if (strcmp(argv[0], "watch") == 0)
+    {
+        // rerun a command whenever files change, as this job
+        do_watch(argv);
+    }
+    else if (strcmp(argv[0], "stats") == 0)
+    {
+        // report the shell's own latencies and counters
+        do_stats(argv);
+    }
+    else if (strcmp(argv[0], "echo") == 0)
+    {
+        // print the arguments
+        do_echo(argv);
+    }
+    else if (strcmp(argv[0], "true") == 0)
+    {
+        // succeed
+        laststatus = 0;
+    }
+    else if (strcmp(argv[0], "false") == 0)
+    {
+        // fail
+        laststatus = 1;
+    }
+    else if (strcmp(argv[0], "sleep") == 0)
+    {
+        // wait without giving up the event loop
+        do_sleep(argv);
+    }
+    else if (strcmp(argv[0], "test") == 0 || strcmp(argv[0], "[") == 0)
+    {
+        // evaluate a condition into the exit status
+        do_test(argv);
+    }
+    else if (strcmp(argv[0], "cd") == 0)
+    {
+        // change the shell's working directory
+        do_cd(argv);
+    }
+    else if (strcmp(argv[0], "pwd") == 0)
+    {
+        // print the working directory
+        do_pwd(argv);
+    }
+    else
+    {
+        // Not a builtin command
+        return 0;
+    }
+
+    // Was a builtin command
+    return 1;
+}
+
+/*
+ * do_bgfg - Execute the builtin bg and fg commands
+ */
+void do_bgfg(char **argv)
+{
+    // set up the local variables
+    int jid;
+    pid_t pid;
+    struct job_t *job;
+    sigset_t prev;
+
+    // confirm whether there is a second argument
+    if (argv[1] == NULL)
+    {
+        // print error for not having a second argument and return
+        printf("%s command requires PID or %cjobid argument\n", argv[0], '%');
+        return;
+    }
+    else
+    {
+        // check if the second arg is a job
+        if (argv[1][0] == '%')
+        {
+            // get the job number and job
+            jid = atoi(argv[1] + 1);
+            job = getjobjid(jobs, jid);
+
+            // check that the job exists
+            if (job == NULL)
+            {
+                printf("%s: No such job\n", argv[1]);
+                return;
+            }
+        }
+        // check for a process id number
+        else if ((pid = atoi(argv[1])) > 0)
+        {
+            // get the job based on the process id
+            job = getjobpid(jobs, pid);
+
+            // check that the job exists
+            if (job == NULL)
+            {
+                printf("(%s): No such process\n", argv[1]);
+                return;
+            }
+        }
+        else
+        {
+            // print error for not being a job id or pid and return
+            printf("%s: argument must be a PID or %cjobid\n", argv[0], '%');
+            return;
+        }
+
+        // a queued job is started right away, skipping the scheduler
+        if (job->state == QU)
+        {
+            block_sigchld(&prev);
+            if (strcmp(argv[0], "bg") == 0)
+            {
+                pid = startqueued(job, BG);
+                if ((job = getjobpid(jobs, pid)) != NULL)
+                    printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+                restore_mask(&prev);
+            }
+            else
+            {
+                pid = startqueued(job, FG);
+                restore_mask(&prev);
+                laststatus = waitfg(pid);
+            }
+            return;
+        }
+
+        // check if the process is moving to the background or foreground
+        if (strcmp(argv[0], "bg") == 0)
+        {
+            // send the continue signal to the process
+            if (signaljob(job, SIGCONT) == 0)
+            {
+                // change the job state to background
+                job->state = BG;
+                postevent(EV_CONTINUED, job->jid, job->pid, BG);
+
+                // print a confirmation that the job is running
+                printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+            }
+            else
+            {
+                unix_error("continue in background error");
+            }
+        }
+        else
+        {
+            // continue in the foreground
+            if (signaljob(job, SIGCONT) == 0)
+            {
+                // set the job state to foreground
+                job->state = FG;
+                postevent(EV_CONTINUED, job->jid, job->pid, FG);
+
+                // wait for the job to finish in the foreground
+                laststatus = waitfg(job->pid);
+            }
+            else
+            {
+                unix_error("continue in the foreground error");
+            }
+        }
+    }
+}
+
+/*
+ * waitfg - Block until process pid is no longer the foreground process
+ *     and return its exit status as collected by the handler
+ *
+ * SIGCHLD stays blocked except inside waitevent, so a stop or exit
+ * reaped by the handler can't slip in between the check and the wait.
+ */
+int waitfg(pid_t pid)
+{
+    // set up the local variables
+    struct job_t *job;
+    sigset_t prev;
+    int status = 0;
+
+    // block SIGCHLD while we inspect the job
+    block_sigchld(&prev);
+
+    // get and store the job
+    job = getjobpid(jobs, pid);
+
+    // wait for job to leave foreground and check that process is the same
+    while (job != NULL && job->state == FG && job->pid == pid)
+    {
+        // poll the pidfd for exit readiness, serving clients meanwhile
+        waitevent(-1, job->pidfd, NULL, &prev);
+    }
+
+    // pick up how the job ended or stopped, and how long ago
+    cancelled = 0;
+    if (fgreaped == pid)
+    {
+        status = exitcode(fgstatus);
+        cancelled = WIFSIGNALED(fgstatus) && WTERMSIG(fgstatus) == SIGINT;
+        histadd(&hist_fgwait, nowns() - fgreapns);
+    }
+
+    // restore the previous signal mask
+    restore_mask(&prev);
+    return status;
+}
+
+/*************************
+ * Simple builtin routines
+ *************************/
+
+/*
+ * do_echo - Execute the builtin echo command, which understands -n
+ *     and -e like /bin/echo
+ */
+void do_echo(char **argv)
+{
+    int newline = 1, escapes = 0, i, j, c;
+    char *arg;
+
+    // pick off the options
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+    {
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1))
+            break;
+        for (j = 1; argv[i][j]; j++)
+        {
+            if (argv[i][j] == 'n')
+                newline = 0;
+            else
+                escapes = (argv[i][j] == 'e');
+        }
+    }
+
+    for (; argv[i] != NULL; i++)
+    {
+        for (arg = argv[i]; *arg; arg++)
+        {
+            if (!escapes || *arg != '\\' || arg[1] == '\0')
+            {
+                putchar(*arg);
+                continue;
+            }
+            switch (*++arg)
+            {
+            case 'n':
+                putchar('\n');
+                break;
+            case 't':
+                putchar('\t');
+                break;
+            case '\\':
+                putchar('\\');
+                break;
+            case 'c':
+                // stop printing entirely
+                return;
+            case '0':
+                // up to three octal digits
+                for (c = 0, j = 0; j < 3 && arg[1] >= '0' && arg[1] <= '7'; j++)
+                    c = c * 8 + (*++arg - '0');
+                putchar(c);
+                break;
+            default:
+                putchar('\\');
+                putchar(*arg);
+            }
+        }
+        if (argv[i + 1] != NULL)
+            putchar(' ');
+    }
+    if (newline)
+        putchar('\n');
+}
+
+/*
+ * do_cd - Execute the builtin cd command
+ */
+void do_cd(char **argv)
+{
+    char *dir = argv[1];
+    char cwd[MAXLINE];
+
+    if (dir == NULL && (dir = getenv("HOME")) == NULL)
+    {
+        printf("cd: HOME not set\n");
+        laststatus = 1;
+        return;
+    }
+    if (chdir(dir) < 0)
+    {
+        printf("cd: %s: %s\n", dir, strerror(errno));
+        laststatus = 1;
+        return;
+    }
+    if (getcwd(cwd, sizeof(cwd)) != NULL)
+        setenv("PWD", cwd, 1);
+}
+
+/*
+ * do_pwd - Execute the builtin pwd command
+ */
+void do_pwd(char **argv)
+{
+    char cwd[MAXLINE];
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        printf("pwd: %s\n", strerror(errno));
+        laststatus = 1;
+        return;
+    }
+    printf("%s\n", cwd);
+}
+
+/*
+ * do_sleep - Execute the builtin sleep command. The shell keeps
+ *     serving events while it sleeps, and ctrl-c cuts it short.
+ */
+void do_sleep(char **argv)
+{
+    struct timespec now, end, left;
+    double secs;
+    char *rest;
+    sigset_t prev;
+
+    // nan, inf and negative times fail the range check too
+    if (argv[1] == NULL || (secs = strtod(argv[1], &rest), rest == argv[1]) || *rest != '\0' ||
+        !(secs >= 0 && secs <= INT_MAX))
+    {
+        printf("sleep: invalid time interval\n");
+        laststatus = 1;
+        return;
+    }
+
+    // work out when to wake up
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += (time_t)secs;
+    end.tv_nsec += (long)((secs - (time_t)secs) * 1e9);
+    if (end.tv_nsec >= 1000000000L)
+    {
+        end.tv_sec++;
+        end.tv_nsec -= 1000000000L;
+    }
+
+    block_sigchld(&prev);
+    interrupted = 0;
+    while (!interrupted)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left.tv_sec = end.tv_sec - now.tv_sec;
+        left.tv_nsec = end.tv_nsec - now.tv_nsec;
+        if (left.tv_nsec < 0)
+        {
+            left.tv_sec--;
+            left.tv_nsec += 1000000000L;
+        }
+        if (left.tv_sec < 0)
+            break;
+        waitevent(-1, -1, &left, &prev);
+    }
+    if (interrupted)
+    {
+        laststatus = 128 + SIGINT;
+        cancelled = 1;
+    }
+    restore_mask(&prev);
+}
+
+/*
+ * do_test - Execute the builtin test and [ commands. Supports !, the
+ *     file tests -e -f -d -r -w -x -s, the string tests -z -n = !=,
+ *     and the integer comparisons -eq -ne -lt -le -gt -ge.
+ */
+void do_test(char **argv)
+{
+    struct stat sb;
+    char **args = argv + 1;
+    char *end;
+    int argc = 0, negate = 0, result, i;
+    long a, b, n[2];
+
+    while (args[argc] != NULL)
+        argc++;
+
+    // [ needs its closing bracket
+    if (strcmp(argv[0], "[") == 0)
+    {
+        if (argc == 0 || strcmp(args[argc - 1], "]") != 0)
+        {
+            printf("[: missing ']'\n");
+            laststatus = 2;
+            return;
+        }
+        argc--;
+    }
+
+    if (argc > 0 && strcmp(args[0], "!") == 0)
+    {
+        negate = 1;
+        args++;
+        argc--;
+    }
+
+    if (argc == 0)
+    {
+        result = 0;
+    }
+    else if (argc == 1)
+    {
+        result = args[0][0] != '\0';
+    }
+    else if (argc == 2 && args[0][0] == '-' && strlen(args[0]) == 2)
+    {
+        switch (args[0][1])
+        {
+        case 'z':
+            result = args[1][0] == '\0';
+            break;
+        case 'n':
+            result = args[1][0] != '\0';
+            break;
+        case 'e':
+            result = stat(args[1], &sb) == 0;
+            break;
+        case 'f':
+            result = stat(args[1], &sb) == 0 && S_ISREG(sb.st_mode);
+            break;
+        case 'd':
+            result = stat(args[1], &sb) == 0 && S_ISDIR(sb.st_mode);
+            break;
+        case 's':
+            result = stat(args[1], &sb) == 0 && sb.st_size > 0;
+            break;
+        case 'r':
+            result = access(args[1], R_OK) == 0;
+            break;
+        case 'w':
+            result = access(args[1], W_OK) == 0;
+            break;
+        case 'x':
+            result = access(args[1], X_OK) == 0;
+            break;
+        default:
+            printf("%s: %s: unary operator expected\n", argv[0], args[0]);
+            laststatus = 2;
+            return;
+        }
+    }
+    else if (argc == 3 && strcmp(args[1], "=") == 0)
+    {
+        result = strcmp(args[0], args[2]) == 0;
+    }
+    else if (argc == 3 && strcmp(args[1], "!=") == 0)
+    {
+        result = strcmp(args[0], args[2]) != 0;
+    }
+    else if (argc == 3 && args[1][0] == '-')
+    {
+        // both sides must be whole integers that fit
+        for (i = 0; i < 2; i++)
+        {
+            errno = 0;
+            n[i] = strtol(args[2 * i], &end, 10);
+            if (errno != 0 || end == args[2 * i] || *end != '\0')
+            {
+                printf("%s: %s: integer expression expected\n", argv[0], args[2 * i]);
+                laststatus = 2;
+                return;
+            }
+        }
+        a = n[0];
+        b = n[1];
+        if (strcmp(args[1], "-eq") == 0)
+            result = a == b;
+        else if (strcmp(args[1], "-ne") == 0)
+            result = a != b;
+        else if (strcmp(args[1], "-lt") == 0)
+            result = a < b;
+        else if (strcmp(args[1], "-le") == 0)
+            result = a <= b;
+        else if (strcmp(args[1], "-gt") == 0)
+            result = a > b;
+        else if (strcmp(args[1], "-ge") == 0)
+            result = a >= b;
+        else
+        {
+            printf("%s: %s: binary operator expected\n", argv[0], args[1]);
+            laststatus = 2;
+            return;
+        }
+    }
+    else
+    {
+        printf("%s: too many arguments\n", argv[0]);
+        laststatus = 2;
+        return;
+    }
+
+    laststatus = (result != negate) ? 0 : 1;
+}
+
+/*****************************
+ * End simple builtin routines
+ *****************************/
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/*
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+ *     available zombie children, but doesn't wait for any other
+ *     currently running children to terminate.
+ */
+void sigchld_handler(int sig)
+{
+    // set up all local variables
+    struct job_t *job;
+    pid_t pid;
+    int jid;
+    int status;
+    int reaped = 0;
+    long long start = nowns(), now, launched;
+
+    // check if any child process changes state
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0)
+    {
+        // get the job id for later
+        jid = pid2jid(pid);
+        now = nowns();
+        histadd(&hist_reap, now - start);
+        if (reaped++ > 0)
+        {
+            stats_coalesced++;
+        }
+
+        // keep the status of the foreground job for waitfg
+        job = getjobpid(jobs, pid);
+        launched = (job != NULL) ? job->start : now;
+        if (job != NULL && job->state == FG)
+        {
+            fgreaped = pid;
+            fgstatus = status;
+            fgreapns = now;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+        {
+            stats_reaped++;
+        }
+
+        // check if the process finished
+        if (WIFEXITED(status))
+        {
+            // delete the job and tell any subscribers
+            if (deletejob(jobs, pid))
+            {
+                histadd(&hist_lifetime, now - launched);
+                postevent(EV_EXITED, jid, pid, WEXITSTATUS(status));
+            }
+        }
+        // check if the process was interrupted
+        else if (WIFSIGNALED(status))
+        {
+            // delete the job and print the confirmation
+            if (deletejob(jobs, pid))
+            {
+                histadd(&hist_lifetime, now - launched);
+                postevent(EV_SIGNALED, jid, pid, WTERMSIG(status));
+                safe_write("Job [", 5);
+                safe_write_int(jid);
+                safe_write("] (", 3);
+                safe_write_int(pid);
+                safe_write(") terminated by signal ", 23);
+                safe_write_int(WTERMSIG(status));
+                safe_write("\n", 1);
+            }
+        }
+        // check if the process was stopped
+        else if (WIFSTOPPED(status))
+        {
+            // get the job for processing
+            job = getjobpid(jobs, pid);
+
+            // check the job exists and print a stop confirmation
+            if (job != NULL)
+            {
+                job->state = ST;
+                postevent(EV_STOPPED, jid, pid, WSTOPSIG(status));
+                safe_write("Job [", 5);
+                safe_write_int(jid);
+                safe_write("] (", 3);
+                safe_write_int(pid);
+                safe_write(") stopped by signal ", 20);
+                safe_write_int(WSTOPSIG(status));
+                safe_write("\n", 1);
+            }
+        }
+    }
+}
+
+/*
+ * safe_write - Uses the write system call to print out messages in
+ *      an async-signal-safe way.
+ */
+void safe_write(char *str, int size)
+{
+    // use write to safely print a message
+    if (write(STDOUT_FILENO, str, size) == -1)
+    {
+        unix_error("write error");
+    }
+}
+
+/*
+ * safe_write_int - On the fly calculates a string from a given int
+ *      and prints it using better print.
+ */
+void safe_write_int(int value)
+{
+    // buffer to hold the string
+    char buffer[20];
+    int i = 0;
+
+    // check for negative
+    if (value < 0)
+    {
+        // print the '-' and convert to positive
+        safe_write("-", 1);
+        value = -value;
+    }
+
+    // convert the integer to a string in reverse order
+    do
+    {
+        buffer[i++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    // safely print the string in reverse order
+    while (i > 0)
+    {
+        safe_write(&buffer[--i], 1);
+    }
+}
+
+/*
+ * open_pidfd - Obtain a pidfd for a child that hasn't been reaped yet.
+ *     Returns -1 if the kernel doesn't support pidfds.
+ */
+int open_pidfd(pid_t pid)
+{
+    // the pid can't be recycled until we reap it, so this is race-free
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+/*
+ * signaljob - Send a signal to a job's process group. The pidfd is used
+ *     when available so a recycled pid can never be signalled by mistake.
+ */
+int signaljob(struct job_t *job, int sig)
+{
+    // a queued job has no process yet
+    if (job->pid == 0)
+    {
+        errno = ESRCH;
+        return -1;
+    }
+
+    // try the pidfd first
+    if (job->pidfd >= 0 &&
+        syscall(SYS_pidfd_send_signal, job->pidfd, sig, NULL,
+                PIDFD_SIGNAL_PROCESS_GROUP) == 0)
+    {
+        return 0;
+    }
+
+    // older kernels lack the group flag; the leader is still unreaped
+    // while the job is listed, so its pgid can't have been reused
+    return kill(-(job->pid), sig);
+}
+
+/*
+ * sigint_handler - The kernel sends a SIGINT to the shell whenever the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job.
+ */
+void sigint_handler(int sig)
+{
+    // get the current fg job
+    long long start = nowns();
+    struct job_t *job = getjobpid(jobs, fgpid(jobs));
+
+    // check that the process exists
+    if (job != NULL)
+    {
+        // send the interrupt signal to the process
+        if (signaljob(job, SIGINT) == -1)
+        {
+            unix_error("failed to interrupt");
+        }
+        histadd(&hist_forward, nowns() - start);
+    }
+    else
+    {
+        // let a builtin that is following output stop
+        interrupted = 1;
+    }
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP.
+ */
+void sigtstp_handler(int sig)
+{
+    // get the current fg job
+    long long start = nowns();
+    struct job_t *job = getjobpid(jobs, fgpid(jobs));
+
+    // check that the process exists
+    if (job != NULL)
+    {
+        // send the stop signal to the process
+        if (signaljob(job, SIGTSTP) == -1)
+        {
+            unix_error("failed to stop");
+        }
+        histadd(&hist_forward, nowns() - start);
+    }
+}
+
+/*********************
+ * End signal handlers
+ *********************/
+
+/*****************************************
+ * Event loop and control socket routines
+ *****************************************/
+
+/*
+ * block_sigchld - Block SIGCHLD, saving the previous mask in prev
+ */
+void block_sigchld(sigset_t *prev)
+{
+    sigset_t mask;
+
+    if (sigemptyset(&mask) != 0 || sigaddset(&mask, SIGCHLD) != 0)
+    {
+        unix_error("sigset error");
+    }
+    if (sigprocmask(SIG_BLOCK, &mask, prev) != 0)
+    {
+        unix_error("sigprocmask blocking error");
+    }
+}
+
+/*
+ * restore_mask - Reinstall a mask saved by block_sigchld
+ */
+void restore_mask(sigset_t *prev)
+{
+    if (sigprocmask(SIG_SETMASK, prev, NULL) != 0)
+    {
+        unix_error("sigprocmask unblocking error");
+    }
+}
+
+/*
+ * readcmd - Read the next command line from stdin into cmdline, like
+ *     fgets, but serve the control socket while waiting for input.
+ *     Returns 0 on end of file.
+ */
+int readcmd(char *cmdline)
+{
+    static char inbuf[MAXLINE]; /* bytes read but not yet returned */
+    static int inlen = 0;       /* number of bytes in inbuf */
+    char *nl;
+    int n, len;
+    sigset_t prev;
+
+    block_sigchld(&prev);
+    while ((nl = memchr(inbuf, '\n', inlen)) == NULL && inlen < MAXLINE - 1)
+    {
+        // wait until stdin is readable, then take what is there
+        if (!waitevent(STDIN_FILENO, -1, NULL, &prev))
+        {
+            continue;
+        }
+        if ((n = read(STDIN_FILENO, inbuf + inlen, MAXLINE - 1 - inlen)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            app_error("read error");
+        }
+        if (n == 0)
+        {
+            // end of file; a partial last line is dropped like before
+            restore_mask(&prev);
+            return 0;
+        }
+        inlen += n;
+    }
+    restore_mask(&prev);
+
+    // hand back one line and keep the rest for next time
+    len = (nl != NULL) ? nl - inbuf + 1 : inlen;
+    memcpy(cmdline, inbuf, len);
+    cmdline[len] = '\0';
+    memmove(inbuf, inbuf + len, inlen - len);
+    inlen -= len;
+    return 1;
+}
+
+/*
+ * waitevent - Wait for one round of activity: fd becoming readable,
+ *     the job behind pidfd exiting, a signal, control socket traffic
+ *     or captured job output, which are served before returning, or
+ *     the timeout passing (NULL waits forever). Either descriptor may
+ *     be -1. The caller must have SIGCHLD blocked; prev is the mask to
+ *     wait with. Returns nonzero if fd is readable.
+ */
+int waitevent(int fd, int pidfd, struct timespec *timeout, sigset_t *prev)
+{
+    // set up the local variables
+    struct pollfd pfds[MAXCLIENTS + MAXLOGS + 3];
+    struct client_t *who[MAXCLIENTS];
+    struct joblog_t *out[MAXLOGS];
+    struct timespec tick;
+    int nfds = 0, nclients = 0, nlogs = 0, fdidx = -1, pididx = -1, ctlidx = -1;
+    int i;
+
+    // deliver anything the handler queued before going to sleep
+    flushevents();
+
+    // start queued jobs the machine has room for, and keep checking
+    // the load while any are left
+    admit();
+    if (nextqueued() != NULL &&
+        (timeout == NULL || timeout->tv_sec > 0 || timeout->tv_nsec > SCHEDTICK))
+    {
+        tick.tv_sec = 0;
+        tick.tv_nsec = SCHEDTICK;
+        timeout = &tick;
+    }
+
+    // gather the descriptors worth waking up for
+    if (fd >= 0)
+    {
+        fdidx = nfds++;
+        pfds[fdidx].fd = fd;
+    }
+    if (pidfd >= 0)
+    {
+        pididx = nfds++;
+        pfds[pididx].fd = pidfd;
+    }
+    if (ctl_fd >= 0)
+    {
+        ctlidx = nfds++;
+        pfds[ctlidx].fd = ctl_fd;
+    }
+    for (i = 0; ctl_fd >= 0 && i < MAXCLIENTS; i++)
+    {
+        if (clients[i].fd >= 0)
+        {
+            who[nclients++] = &clients[i];
+            pfds[nfds++].fd = clients[i].fd;
+        }
+    }
+    for (i = 0; i < MAXLOGS; i++)
+    {
+        if (logs[i].fd >= 0 && logs[i].pid != 0)
+        {
+            out[nlogs++] = &logs[i];
+            pfds[nfds++].fd = logs[i].fd;
+        }
+    }
+    for (i = 0; i < nfds; i++)
+    {
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
+    }
+
+    // sleep with SIGCHLD unblocked
+    if (ppoll(pfds, nfds, timeout, prev) < 0)
+    {
+        if (errno != EINTR)
+        {
+            unix_error("ppoll error");
+        }
+        return 0;
+    }
+
+    // the job exited but isn't reaped yet, so its SIGCHLD is pending;
+    // let the handler run before the caller checks again
+    if (pididx >= 0 && (pfds[pididx].revents & POLLIN))
+    {
+        sigsuspend(prev);
+    }
+
+    // serve the control socket
+    if (ctlidx >= 0 && (pfds[ctlidx].revents & POLLIN))
+    {
+        ctl_accept();
+    }
+    for (i = 0; i < nclients; i++)
+    {
+        if (pfds[nfds - nlogs - nclients + i].revents)
+        {
+            ctl_read(who[i]);
+        }
+    }
+
+    // drain captured output
+    for (i = 0; i < nlogs; i++)
+    {
+        if (pfds[nfds - nlogs + i].revents)
+        {
+            drainlog(out[i]);
+        }
+    }
+
+    return fdidx >= 0 && (pfds[fdidx].revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+/*
+ * postevent - Queue a job-state change for the control clients. Safe
+ *     to call from the signal handlers.
+ */
+void postevent(int type, int jid, pid_t pid, int code)
+{
+    sigset_t prev;
+
+    if (ctl_fd < 0)
+        return;
+
+    // keep the handler out while we touch the ring
+    block_sigchld(&prev);
+    if (evhead - evtail < MAXEVENTS)
+    {
+        events[evhead % MAXEVENTS].type = type;
+        events[evhead % MAXEVENTS].jid = jid;
+        events[evhead % MAXEVENTS].pid = pid;
+        events[evhead % MAXEVENTS].code = code;
+        evhead++;
+    }
+    restore_mask(&prev);
+}
+
+/*
+ * flushevents - Send queued events to subscribers and answer clients
+ *     waiting on jobs that have finished. Call with SIGCHLD blocked.
+ */
+void flushevents(void)
+{
+    static char *names[] = {"started", "stopped", "continued", "exited", "signaled"};
+    struct event_t *ev;
+    char msg[MAXLINE];
+    int i;
+
+    if (ctl_fd < 0)
+        return;
+
+    while (evtail != evhead)
+    {
+        ev = &events[evtail % MAXEVENTS];
+        evtail++;
+        snprintf(msg, sizeof(msg), "{\"event\":\"%s\",\"jid\":%d,\"pid\":%d,\"code\":%d}\n",
+                 names[ev->type], ev->jid, ev->pid, ev->code);
+        for (i = 0; i < MAXCLIENTS; i++)
+        {
+            if (clients[i].fd < 0)
+                continue;
+            if (clients[i].subscribed)
+                ctl_send(&clients[i], msg);
+            if (clients[i].fd >= 0 && clients[i].waiting == ev->jid &&
+                (ev->type == EV_EXITED || ev->type == EV_SIGNALED))
+            {
+                clients[i].waiting = 0;
+                snprintf(msg, sizeof(msg),
+                         "{\"ok\":true,\"jid\":%d,\"pid\":%d,\"status\":\"%s\",\"code\":%d}\n",
+                         ev->jid, ev->pid, names[ev->type], ev->code);
+                ctl_send(&clients[i], msg);
+            }
+        }
+    }
+
+    // the ring can overflow; don't leave a waiter hanging on a lost event
+    for (i = 0; i < MAXCLIENTS; i++)
+    {
+        if (clients[i].fd >= 0 && clients[i].waiting != 0 &&
+            getjobjid(jobs, clients[i].waiting) == NULL)
+        {
+            snprintf(msg, sizeof(msg), "{\"ok\":true,\"jid\":%d,\"status\":\"gone\"}\n",
+                     clients[i].waiting);
+            clients[i].waiting = 0;
+            ctl_send(&clients[i], msg);
+        }
+    }
+}
+
+/*
+ * ctl_open - Listen for control clients on a Unix-domain socket
+ */
+void ctl_open(char *path)
+{
+    struct sockaddr_un addr;
+    int i;
+
+    for (i = 0; i < MAXCLIENTS; i++)
+        clients[i].fd = -1;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        app_error("control socket path too long");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // replace a stale socket left behind by an earlier shell
+    unlink(path);
+    if ((ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        unix_error("socket error");
+    if (bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        unix_error("bind error");
+    if (listen(ctl_fd, MAXCLIENTS) < 0)
+        unix_error("listen error");
+
+    ctl_owner = getpid();
+    atexit(ctl_cleanup);
+}
+
+/*
+ * ctl_cleanup - Remove the control socket when the shell exits
+ */
+void ctl_cleanup(void)
+{
+    // children that fail to exec run atexit handlers too
+    if (getpid() == ctl_owner)
+        unlink(ctl_path);
+}
+
+/*
+ * ctl_accept - Take a new control client, refusing it if we're full
+ */
+void ctl_accept(void)
+{
+    int fd, i;
+
+    if ((fd = accept4(ctl_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+        return;
+
+    for (i = 0; i < MAXCLIENTS; i++)
+    {
+        if (clients[i].fd < 0)
+        {
+            clients[i].fd = fd;
+            clients[i].subscribed = 0;
+            clients[i].waiting = 0;
+            clients[i].len = 0;
+            return;
+        }
+    }
+    close(fd);
+}
+
+/*
+ * ctl_read - Read from a control client and run each complete request
+ */
+void ctl_read(struct client_t *client)
+{
+    char *start, *nl;
+    int n;
+
+    n = read(client->fd, client->buf + client->len, MAXLINE - 1 - client->len);
+    if (n <= 0)
+    {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        ctl_drop(client);
+        return;
+    }
+    client->len += n;
+
+    // requests are newline-terminated lines
+    start = client->buf;
+    while (client->fd >= 0 &&
+           (nl = memchr(start, '\n', client->len - (start - client->buf))) != NULL)
+    {
+        *nl = '\0';
+        ctl_request(client, start);
+        start = nl + 1;
+    }
+    if (client->fd < 0)
+        return;
+    client->len -= start - client->buf;
+    memmove(client->buf, start, client->len);
+
+    // a request that fills the buffer can never complete
+    if (client->len == MAXLINE - 1)
+    {
+        ctl_send(client, "{\"ok\":false,\"error\":\"request too long\"}\n");
+        ctl_drop(client);
+    }
+}
+
+/*
+ * ctl_request - Carry out one control request. The protocol is one
+ *     request per line and one JSON object per line in reply:
+ *         submit <cmdline>       start cmdline as a background job
+ *         list                   describe every job
+ *         signal <%jid|pid> <n>  send signal n to a job
+ *         wait <%jid|pid>        reply once the job has finished
+ *         subscribe              stream every job-state event
+ */
+void ctl_request(struct client_t *client, char *req)
+{
+    static char msg[MAXJOBS * 2 * MAXLINE + MAXLINE]; /* list replies */
+    char cmdline[MAXLINE], esc[2 * MAXLINE];
+    struct plan_t plan;
+    char *verb, *arg;
+    struct job_t *job = NULL;
+    int i, len, sig;
+
+    // split off the verb and find the job argument if there is one
+    verb = req;
+    if ((arg = strchr(req, ' ')) != NULL)
+    {
+        *arg++ = '\0';
+        while (*arg == ' ')
+            arg++;
+        if (arg[0] == '%')
+            job = getjobjid(jobs, atoi(arg + 1));
+        else
+            job = getjobpid(jobs, atoi(arg));
+    }
+
+    if (strcmp(verb, "submit") == 0 && arg != NULL)
+    {
+        // submitted lines always run in the background as one job
+        snprintf(cmdline, sizeof(cmdline), "%s\n", arg);
+        if (parseline(cmdline, &plan) < 0 || plan.root < 0)
+        {
+            ctl_send(client, "{\"ok\":false,\"error\":\"bad command\"}\n");
+            return;
+        }
+        if (plan.nodes[plan.root].type == N_BG)
+            plan.root = plan.nodes[plan.root].left;
+        if ((job = getjobjid(jobs, submitjob(&plan, plan.root, cmdline))) == NULL)
+        {
+            ctl_send(client, "{\"ok\":false,\"error\":\"too many jobs\"}\n");
+            return;
+        }
+        snprintf(msg, sizeof(msg), "{\"ok\":true,\"jid\":%d,\"pid\":%d,\"state\":\"%s\"}\n",
+                 job->jid, job->pid, statename(job->state));
+        ctl_send(client, msg);
+    }
+    else if (strcmp(verb, "list") == 0)
+    {
+        len = snprintf(msg, sizeof(msg), "{\"ok\":true,\"jobs\":[");
+        for (i = 0; i < MAXJOBS; i++)
+        {
+            if (jobs[i].jid == 0)
+                continue;
+            len += snprintf(msg + len, sizeof(msg) - len,
+                            "%s{\"jid\":%d,\"pid\":%d,\"state\":\"%s\",\"cmdline\":\"%s\"}",
+                            msg[len - 1] == '[' ? "" : ",", jobs[i].jid, jobs[i].pid,
+                            statename(jobs[i].state),
+                            jsonstr(esc, jobs[i].cmdline, sizeof(esc)));
+        }
+        snprintf(msg + len, sizeof(msg) - len, "]}\n");
+        ctl_send(client, msg);
+    }
+    else if (strcmp(verb, "signal") == 0 && job != NULL &&
+             (arg = strchr(arg, ' ')) != NULL && (sig = atoi(arg + 1)) > 0)
+    {
+        if (signaljob(job, sig) < 0)
+        {
+            snprintf(msg, sizeof(msg), "{\"ok\":false,\"error\":\"%s\"}\n", strerror(errno));
+            ctl_send(client, msg);
+            return;
+        }
+        // a continued job keeps running wherever it was
+        if (sig == SIGCONT && job->state == ST)
+        {
+            job->state = BG;
+            postevent(EV_CONTINUED, job->jid, job->pid, BG);
+        }
+        ctl_send(client, "{\"ok\":true}\n");
+    }
+    else if (strcmp(verb, "wait") == 0 && job != NULL)
+    {
+        // answered by flushevents when the job finishes; by jid, since
+        // a queued job has no pid until the scheduler starts it
+        client->waiting = job->jid;
+    }
+    else if (strcmp(verb, "subscribe") == 0)
+    {
+        client->subscribed = 1;
+        ctl_send(client, "{\"ok\":true}\n");
+    }
+    else if (arg != NULL && (strcmp(verb, "signal") == 0 || strcmp(verb, "wait") == 0))
+    {
+        ctl_send(client, "{\"ok\":false,\"error\":\"No such job\"}\n");
+    }
+    else
+    {
+        ctl_send(client, "{\"ok\":false,\"error\":\"bad request\"}\n");
+    }
+}
+
+/*
+ * ctl_send - Send a reply without blocking; a client that can't keep
+ *     up is dropped rather than stalling the shell.
+ */
+void ctl_send(struct client_t *client, char *msg)
+{
+    size_t len = strlen(msg);
+
+    if (send(client->fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)len)
+    {
+        ctl_drop(client);
+    }
+}
+
+/*
+ * ctl_drop - Disconnect a control client
+ */
+void ctl_drop(struct client_t *client)
+{
+    close(client->fd);
+    client->fd = -1;
+    client->subscribed = 0;
+    client->waiting = 0;
+    client->len = 0;
+}
+
+/*
+ * jsonstr - Escape src as the body of a JSON string, dropping the
+ *     trailing newline that command lines carry. Returns dst.
+ */
+char *jsonstr(char *dst, const char *src, size_t size)
+{
+    size_t i = 0;
+
+    for (; *src && i + 7 < size; src++)
+    {
+        if (*src == '\n' && src[1] == '\0')
+            break;
+        if (*src == '"' || *src == '\\')
+        {
+            dst[i++] = '\\';
+            dst[i++] = *src;
+        }
+        else if ((unsigned char)*src < 0x20)
+        {
+            i += snprintf(dst + i, size - i, "\\u%04x", *src);
+        }
+        else
+        {
+            dst[i++] = *src;
+        }
+    }
+    dst[i] = '\0';
+    return dst;
+}
+
+/*
+ * statename - Name a job state the way listjobs does
+ */
+char *statename(int state)
+{
+    switch (state)
+    {
+    case BG:
+        return "Running";
+    case FG:
+        return "Foreground";
+    case ST:
+        return "Stopped";
+    case QU:
+        return "Queued";
+    default:
+        return "Undefined";
+    }
+}
+
+/*********************************************
+ * End event loop and control socket routines
+ *********************************************/
+
+/******************************
+ * Admission scheduler routines
+ ******************************/
+
+/*
+ * submitjob - Start node n of a plan as a background job, or queue it
+ *     if the scheduler is on. Call with SIGCHLD blocked. Returns the
+ *     job's jid, or 0 if it couldn't be added.
+ */
+int submitjob(struct plan_t *plan, int n, char *cmdline)
+{
+    struct job_t *job;
+    int jid;
+
+    if (!sched_on)
+    {
+        return pid2jid(launch(plan, n, BG, cmdline, 0, NULL));
+    }
+
+    // queue it with what it starts from, then see if there is room to
+    // start it right away
+    jid = queuejob(jobs, jobprio(plan, n), cmdline);
+    if ((job = getjobjid(jobs, jid)) != NULL)
+        job->queued = savequeued(plan, n);
+    admit();
+    return jid;
+}
+
+/*
+ * jobprio - Return the priority class named by a "prio <class>"
+ *     prefix on a simple command, or PRIO_NORMAL
+ */
+int jobprio(struct plan_t *plan, int n)
+{
+    int prio, cached;
+
+    cmdprefix(plan, &plan->nodes[n], &prio, &cached);
+    return prio;
+}
+
+/*
+ * cmdprefix - Count the words of the "prio <class>" and "cached"
+ *     prefixes of a simple command, in either order, and report the
+ *     class (PRIO_NORMAL if none) and whether it is cached. A prefix
+ *     word is never the command itself.
+ */
+int cmdprefix(struct plan_t *plan, struct node_t *node, int *prio, int *cached)
+{
+    int skip = 0, class;
+    char *word;
+
+    *prio = PRIO_NORMAL;
+    *cached = 0;
+    while (node->type == N_CMD && skip < node->argc - 1)
+    {
+        word = plan->buf + plan->words[node->argv + skip];
+        if (strcmp(word, "cached") == 0 && !*cached)
+        {
+            *cached = 1;
+            skip += 1;
+        }
+        else if (strcmp(word, "prio") == 0 && skip < node->argc - 2 &&
+                 (class = prioclass(plan->buf + plan->words[node->argv + skip + 1])) >= 0)
+        {
+            *prio = class;
+            skip += 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return skip;
+}
+
+/*
+ * prioclass - Map a class name to PRIO_HIGH, PRIO_NORMAL or
+ *     PRIO_LOW, or -1 if it isn't one
+ */
+int prioclass(char *name)
+{
+    if (strcmp(name, "high") == 0)
+        return PRIO_HIGH;
+    if (strcmp(name, "normal") == 0)
+        return PRIO_NORMAL;
+    if (strcmp(name, "low") == 0)
+        return PRIO_LOW;
+    return -1;
+}
+
+/*
+ * startqueued - Launch a queued job in the given state, keeping its
+ *     jid, from the plan and directory it was submitted with. Call
+ *     with SIGCHLD blocked. Returns the new pid.
+ */
+pid_t startqueued(struct job_t *job, int state)
+{
+    struct queued_t *q = job->queued;
+    char cmdline[MAXLINE], *value;
+    int jid = job->jid, status, i;
+    pid_t pid;
+
+    strcpy(cmdline, job->cmdline);
+    job->queued = NULL;
+    clearjob(job);
+    if (q == NULL)
+        return 0;
+
+    if (verbose)
+    {
+        printf("Admitted job [%d] %s", jid, cmdline);
+    }
+    // swap in the submitted variables while the child is started,
+    // which leaves ours in q to be freed
+    for (i = 0; i < q->nvals; i++)
+    {
+        value = vars[i].value;
+        vars[i].value = q->vals[i];
+        q->vals[i] = value;
+    }
+    status = laststatus;
+    laststatus = q->status;
+    launchdir = q->cwd;
+    pid = launch(&q->plan, q->node, state, cmdline, jid, q->expanded ? &q->args : NULL);
+    launchdir = -1;
+    laststatus = status;
+    for (i = 0; i < q->nvals; i++)
+    {
+        value = vars[i].value;
+        vars[i].value = q->vals[i];
+        q->vals[i] = value;
+    }
+    freequeued(q);
+    return pid;
+}
+
+/*
+ * savequeued - Keep what node n of a plan needs to be started later:
+ *     a copy of the plan, so the line isn't parsed again, and the
+ *     current directory, so it starts where it was submitted. A simple
+ *     command's words are expanded now; anything else keeps the
+ *     variables' values to run with. Either way, the job sees them as
+ *     they were when it was submitted.
+ */
+struct queued_t *savequeued(struct plan_t *plan, int n)
+{
+    struct queued_t *q;
+    struct node_t *node;
+    int i;
+
+    if ((q = malloc(sizeof(*q))) == NULL)
+        unix_error("malloc error");
+    memcpy(&q->plan, plan, sizeof(*plan));
+    snprintf(q->line, sizeof(q->line), "%s", plan->line);
+    q->plan.line = q->line;
+    q->plan.busy = 0;
+    q->node = n;
+    q->cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    // process substitutions can only be started by the job itself
+    node = &q->plan.nodes[n];
+    q->expanded = (node->type == N_CMD && !hassubst(&q->plan, node));
+    if (q->expanded)
+        buildargv(&q->plan, node, &q->args);
+    for (q->nvals = nvars, i = 0; i < nvars; i++)
+    {
+        q->vals[i] = NULL;
+        if (vars[i].value != NULL && (q->vals[i] = strdup(vars[i].value)) == NULL)
+            unix_error("strdup error");
+    }
+    q->status = laststatus;
+    return q;
+}
+
+/*
+ * freequeued - Release what savequeued kept
+ */
+void freequeued(struct queued_t *q)
+{
+    int i;
+
+    if (q == NULL)
+        return;
+    if (q->cwd >= 0)
+        close(q->cwd);
+    if (q->expanded)
+        freeargs(&q->args);
+    for (i = 0; i < q->nvals; i++)
+        free(q->vals[i]);
+    free(q);
+}
+
+/*
+ * nextqueued - Return the queued job to admit next: the highest
+ *     priority class first, oldest first within a class
+ */
+struct job_t *nextqueued(void)
+{
+    struct job_t *next = NULL;
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+    {
+        if (jobs[i].state != QU)
+            continue;
+        if (next == NULL || jobs[i].prio < next->prio ||
+            (jobs[i].prio == next->prio && jobs[i].seq < next->seq))
+        {
+            next = &jobs[i];
+        }
+    }
+    return next;
+}
+
+/*
+ * admit - Start queued jobs while the number of running background
+ *     jobs and the system load stay under the limits. With the
+ *     scheduler off, everything still queued starts. Call with
+ *     SIGCHLD blocked.
+ */
+void admit(void)
+{
+    struct job_t *job;
+    int running, i;
+
+    while ((job = nextqueued()) != NULL)
+    {
+        if (sched_on)
+        {
+            for (running = 0, i = 0; i < MAXJOBS; i++)
+                if (jobs[i].state == BG)
+                    running++;
+            if (running >= (sched_max > 0 ? sched_max : sysconf(_SC_NPROCESSORS_ONLN)) ||
+                overloaded())
+            {
+                return;
+            }
+        }
+        startqueued(job, BG);
+    }
+}
+
+/*
+ * overloaded - Return true if CPU, memory or IO pressure or the run
+ *     queue is above its threshold. A threshold of 0 is ignored.
+ */
+int overloaded(void)
+{
+    int runq = sched_runq > 0 ? sched_runq : 2 * sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (sched_cpu > 0 && readpsi("/proc/pressure/cpu") > sched_cpu) ||
+           (sched_memory > 0 && readpsi("/proc/pressure/memory") > sched_memory) ||
+           (sched_io > 0 && readpsi("/proc/pressure/io") > sched_io) ||
+           readrunq() > runq;
+}
+
+/*
+ * readpsi - Return the "some avg10" figure from a PSI file, or 0 if
+ *     the kernel doesn't provide it
+ */
+double readpsi(char *path)
+{
+    char buf[256];
+    double avg10 = 0;
+    int fd, n;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    sscanf(buf, "some avg10=%lf", &avg10);
+    return avg10;
+}
+
+/*
+ * readrunq - Return the number of runnable tasks from /proc/loadavg,
+ *     or 0 if it can't be read
+ */
+int readrunq(void)
+{
+    char buf[128];
+    double l1, l5, l15;
+    int fd, n, running = 0;
+
+    if ((fd = open("/proc/loadavg", O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    sscanf(buf, "%lf %lf %lf %d/", &l1, &l5, &l15, &running);
+    return running;
+}
+
+/*
+ * do_sched - Execute the builtin sched command:
+ *     sched                       show the settings and queue length
+ *     sched on|off                turn admission control on or off
+ *     sched cpu=N memory=N io=N   PSI some avg10 limits in percent
+ *     sched runq=N max=N          run queue and running job limits
+ *     Settings can be combined, and 0 means no limit (or the default
+ *     for runq and max).
+ */
+void do_sched(char **argv)
+{
+    int i, queued;
+    sigset_t prev;
+
+    for (i = 1; argv[i] != NULL; i++)
+    {
+        if (strcmp(argv[i], "on") == 0)
+            sched_on = 1;
+        else if (strcmp(argv[i], "off") == 0)
+            sched_on = 0;
+        else if (strncmp(argv[i], "cpu=", 4) == 0)
+            sched_cpu = atof(argv[i] + 4);
+        else if (strncmp(argv[i], "memory=", 7) == 0)
+            sched_memory = atof(argv[i] + 7);
+        else if (strncmp(argv[i], "io=", 3) == 0)
+            sched_io = atof(argv[i] + 3);
+        else if (strncmp(argv[i], "runq=", 5) == 0)
+            sched_runq = atoi(argv[i] + 5);
+        else if (strncmp(argv[i], "max=", 4) == 0)
+            sched_max = atoi(argv[i] + 4);
+        else
+        {
+            printf("sched: unknown setting %s\n", argv[i]);
+            laststatus = 1;
+            return;
+        }
+    }
+
+    // settings may have made room, and off releases the whole queue
+    block_sigchld(&prev);
+    if (argv[1] != NULL)
+        admit();
+    for (queued = 0, i = 0; i < MAXJOBS; i++)
+        if (jobs[i].state == QU)
+            queued++;
+    restore_mask(&prev);
+
+    if (argv[1] == NULL)
+    {
+        printf("sched %s cpu=%g memory=%g io=%g runq=%d max=%d (%d queued)\n",
+               sched_on ? "on" : "off", sched_cpu, sched_memory, sched_io,
+               sched_runq, sched_max, queued);
+    }
+}
+
+/**********************************
+ * End admission scheduler routines
+ **********************************/
+
+/*****************
+ * Zygote routines
+ *****************/
+
+/*
+ * zygote_start - Fork the launcher while the shell is still small.
+ *     Leaves zygote_fd at -1 if it can't be started, in which case
+ *     the shell forks jobs itself.
+ */
+void zygote_start(void)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return;
+    if ((zygote_pid = fork()) < 0)
+    {
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (zygote_pid == 0)
+    {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+    close(sv[1]);
+    zygote_fd = sv[0];
+}
+
+/*
+ * zygote_main - The launcher's loop: take a spawn request, clone a
+ *     child with CLONE_PARENT so it belongs to the shell, and reply
+ *     with its pid. Exits when the shell closes its end.
+ */
+void zygote_main(int fd)
+{
+    static char buf[ZYGOTEMSG];
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct spawnreq_t *req = (struct spawnreq_t *)buf;
+    char *argv[MAXARGS + 1], **envp, *cwd, *p;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int outfd, reply, i;
+    ssize_t n;
+
+    // keyboard signals are for the jobs, not for us
+    Signal(SIGINT, SIG_IGN);
+    Signal(SIGTSTP, SIG_IGN);
+    Signal(SIGQUIT, SIG_IGN);
+
+    while (1)
+    {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        if ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            _exit(0);
+        }
+
+        // an output descriptor comes along for captured jobs
+        outfd = -1;
+        if ((cmsg = CMSG_FIRSTHDR(&msg)) != NULL && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&outfd, CMSG_DATA(cmsg), sizeof(int));
+
+        // unpack cwd, argv and envp, which follow the header
+        p = buf + sizeof(*req);
+        cwd = p;
+        p += strlen(p) + 1;
+        for (i = 0; i < req->argc; i++)
+        {
+            argv[i] = p;
+            p += strlen(p) + 1;
+        }
+        argv[i] = NULL;
+        envp = (char **)malloc((req->envc + 1) * sizeof(char *));
+        for (i = 0; envp != NULL && i < req->envc; i++)
+        {
+            envp[i] = p;
+            p += strlen(p) + 1;
+        }
+
+        if (envp == NULL)
+        {
+            reply = -ENOMEM;
+        }
+        else if ((reply = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0)) == 0)
+        {
+            envp[req->envc] = NULL;
+            zygote_exec(argv, envp, cwd, outfd);
+        }
+        else if (reply < 0)
+        {
+            reply = -errno;
+        }
+
+        send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+        free(envp);
+        if (outfd >= 0)
+            close(outfd);
+    }
+}
+
+/*
+ * zygote_exec - Set up and exec a job in a child of the zygote
+ */
+void zygote_exec(char **argv, char **envp, char *cwd, int outfd)
+{
+    sigset_t mask;
+
+    // child process sets a new group id for itself
+    setpgid(0, 0);
+
+    // undo what the zygote ignores and blocks
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTSTP, SIG_DFL);
+    Signal(SIGQUIT, SIG_DFL);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    // send output into the capture pipe
+    if (outfd >= 0)
+    {
+        dup2(outfd, STDOUT_FILENO);
+        dup2(outfd, STDERR_FILENO);
+    }
+
+    // Execute the command where the shell is
+    if (chdir(cwd) < 0)
+    {
+        printf("%s: %s: %s\n", argv[0], cwd, strerror(errno));
+        fflush(stdout);
+        _exit(1);
+    }
+    if (execve(argv[0], argv, envp) < 0)
+    {
+        printf("%s: Command not found\n", argv[0]);
+        fflush(stdout);
+        _exit(1);
+    }
+}
+
+/*
+ * zygote_spawn - Ask the zygote to start argv, with stdout and stderr
+ *     sent to outfd unless it is -1. Returns the new child's pid, or
+ *     -1 if the caller should fork the job itself.
+ */
+pid_t zygote_spawn(char **argv, int outfd)
+{
+    static char buf[ZYGOTEMSG];
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct spawnreq_t *req = (struct spawnreq_t *)buf;
+    char cwd[MAXLINE], fdpath[32];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    size_t len, n;
+    ssize_t cwdlen;
+    int i, reply;
+
+    // the child starts in launchdir, if one is set, or here
+    if (zygote_fd < 0)
+        return -1;
+    if (launchdir >= 0)
+    {
+        snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", launchdir);
+        if ((cwdlen = readlink(fdpath, cwd, sizeof(cwd) - 1)) < 0)
+            return -1;
+        cwd[cwdlen] = '\0';
+    }
+    else if (getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        return -1;
+    }
+
+    // pack cwd, argv and envp after the header
+    len = sizeof(*req);
+    n = strlen(cwd) + 1;
+    memcpy(buf + len, cwd, n);
+    len += n;
+    for (req->argc = 0; argv[req->argc] != NULL; req->argc++)
+    {
+        // the zygote unpacks at most MAXARGS words
+        if (req->argc == MAXARGS)
+            return -1;
+        if ((n = strlen(argv[req->argc]) + 1) > sizeof(buf) - len)
+            return -1;
+        memcpy(buf + len, argv[req->argc], n);
+        len += n;
+    }
+    for (i = 0; environ[i] != NULL; i++)
+    {
+        // an environment too big for one message is forked the old way
+        if ((n = strlen(environ[i]) + 1) > sizeof(buf) - len)
+            return -1;
+        memcpy(buf + len, environ[i], n);
+        len += n;
+    }
+    req->envc = i;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (outfd >= 0)
+    {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &outfd, sizeof(int));
+    }
+
+    // a zygote that has gone away is not coming back
+    if (sendmsg(zygote_fd, &msg, MSG_NOSIGNAL) != (ssize_t)len ||
+        recv(zygote_fd, &reply, sizeof(reply), 0) != sizeof(reply))
+    {
+        close(zygote_fd);
+        zygote_fd = -1;
+        return -1;
+    }
+    return reply > 0 ? reply : -1;
+}
+
+/*********************
+ * End zygote routines
+ *********************/
+
+/***********************
+ * Result cache routines
+ ***********************/
+
+/*
+ * do_cached - Run a "cached" external command. A stored result for
+ *     the same argv, environment (CACHEENV, or the names listed in
+ *     $TSH_CACHE_ENV) and input files is replayed without starting
+ *     anything. Otherwise the command runs, in the shell as a
+ *     foreground job whose output is captured and shown as it
+ *     arrives, and a clean exit is stored. Output and exit status
+ *     are left as if the command had run.
+ */
+void do_cached(struct plan_t *plan, int n, struct args_t *args)
+{
+    char **argv = args->argv;
+    char key[17], cmdline[MAXLINE + 3];
+    static char buf[LOGSIZE];
+    struct joblog_t *log = NULL;
+    sigset_t prev;
+    FILE *out;
+    long long len;
+    ssize_t got;
+    pid_t pid;
+    int i, status;
+
+    // a command we can't fingerprint just runs
+    if (cachekey(argv, key) < 0)
+        key[0] = '\0';
+    if (key[0] != '\0' && cachereplay(key))
+    {
+        cache_hits++;
+        return;
+    }
+    cache_misses++;
+
+    if (subshell)
+    {
+        // collect the output in a scratch file, then show and keep it
+        fflush(stdout);
+        if ((out = tmpfile()) == NULL)
+        {
+            if ((pid = fork()) == 0)
+                execcmd(argv);
+            laststatus = waitchild(pid);
+            return;
+        }
+        if ((pid = fork()) == 0)
+        {
+            dup2(fileno(out), STDOUT_FILENO);
+            dup2(fileno(out), STDERR_FILENO);
+            execcmd(argv);
+        }
+        while (waitpid(pid, &status, 0) < 0)
+        {
+            if (errno != EINTR)
+            {
+                status = 127 << 8;
+                break;
+            }
+        }
+        laststatus = exitcode(status);
+
+        // a result that fits in one read is small enough to keep
+        lseek(fileno(out), 0, SEEK_SET);
+        for (len = 0; (got = read(fileno(out), buf, LOGSIZE)) > 0; len += got)
+            safe_write(buf, got);
+        if (key[0] != '\0' && WIFEXITED(status) && len <= LOGSIZE)
+            cachestore(key, buf, len, laststatus);
+        fclose(out);
+        return;
+    }
+
+    // run it as a foreground job, so ctrl-c and ctrl-z still work
+    caching = 1;
+    pid = launch(plan, n, FG, jobline(plan, n, cmdline), 0, args);
+    laststatus = waitfg(pid);
+
+    block_sigchld(&prev);
+    for (i = 0; i < MAXLOGS; i++)
+        if (logs[i].pid == pid && logs[i].tee)
+            log = &logs[i];
+    if (log != NULL)
+    {
+        // show what the job wrote after it was last polled
+        while (log->fd >= 0 && drainlog(log))
+            ;
+
+        // a stopped job goes on showing its output once it is
+        // continued, so wait until every writer is gone; keep the
+        // result only if the command exited by itself and the ring
+        // holds all of its output
+        if (getjobpid(jobs, pid) == NULL && log->fd < 0)
+        {
+            log->tee = 0;
+            if (key[0] != '\0' && fgreaped == pid && WIFEXITED(fgstatus) &&
+                log->total <= LOGSIZE)
+            {
+                cachestore(key, log->ring, log->total, laststatus);
+            }
+        }
+    }
+    restore_mask(&prev);
+}
+
+/*
+ * cachedir - Put the cache directory, $TSH_CACHE_DIR or else
+ *     ~/.cache/tsh, into dir and create it if needed. Returns 0, or
+ *     -1 if there is nowhere to keep results.
+ */
+int cachedir(char *dir)
+{
+    char *env;
+
+    if ((env = getenv("TSH_CACHE_DIR")) != NULL && env[0] != '\0')
+    {
+        snprintf(dir, MAXLINE, "%s", env);
+    }
+    else if ((env = getenv("HOME")) != NULL && env[0] != '\0')
+    {
+        snprintf(dir, MAXLINE, "%s/.cache", env);
+        mkdir(dir, 0755);
+        snprintf(dir, MAXLINE, "%s/.cache/tsh", env);
+    }
+    else
+    {
+        return -1;
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+/*
+ * cachekey - Fingerprint a command into key, 16 hex digits: the
+ *     working directory, argv, the environment it depends on and the
+ *     contents of every regular file named in argv, the program
+ *     included. Returns -1 if a named file can't be read.
+ */
+int cachekey(char **argv, char *key)
+{
+    char cwd[MAXLINE], names[MAXLINE], *name, *value, *data;
+    struct stat st;
+    uint64_t h = 0;
+    int i, fd;
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return -1;
+    h = xxh64(cwd, strlen(cwd) + 1, h);
+    for (i = 0; argv[i] != NULL; i++)
+        h = xxh64(argv[i], strlen(argv[i]) + 1, h);
+
+    // the variables, set or not, in a fixed order
+    snprintf(names, sizeof(names), "%s",
+             getenv("TSH_CACHE_ENV") != NULL ? getenv("TSH_CACHE_ENV") : CACHEENV);
+    for (name = strtok(names, ":"); name != NULL; name = strtok(NULL, ":"))
+    {
+        h = xxh64(name, strlen(name) + 1, h);
+        if ((value = getenv(name)) != NULL)
+            h = xxh64(value, strlen(value) + 1, h);
+    }
+
+    // then whatever the command can read from the files it names
+    for (i = 0; argv[i] != NULL; i++)
+    {
+        if (stat(argv[i], &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        if ((fd = open(argv[i], O_RDONLY | O_CLOEXEC)) < 0)
+            return -1;
+        data = (st.st_size > 0) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+        close(fd);
+        if (data == MAP_FAILED)
+            return -1;
+        h = xxh64(&i, sizeof(i), h);
+        h = xxh64(data, st.st_size, h);
+        if (data != NULL)
+            munmap(data, st.st_size);
+    }
+
+    snprintf(key, 17, "%016llx", (unsigned long long)h);
+    return 0;
+}
+
+/*
+ * cachereplay - Replay the stored result for key, if there is one:
+ *     write its output and set laststatus. Returns 1 on a hit.
+ */
+int cachereplay(char *key)
+{
+    char path[MAXLINE + 32], *data;
+    struct cachehdr_t *hdr;
+    struct stat st;
+    int fd, hit = 0;
+
+    if (cachedir(path) < 0)
+        return 0;
+    strcat(path, "/");
+    strcat(path, key);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*hdr) &&
+        (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED)
+    {
+        // a short or foreign file is a miss, and gets overwritten
+        hdr = (struct cachehdr_t *)data;
+        if (hdr->magic == CACHEMAGIC && hdr->len == st.st_size - (off_t)sizeof(*hdr))
+        {
+            fflush(stdout);
+            safe_write(data + sizeof(*hdr), hdr->len);
+            laststatus = hdr->status;
+            hit = 1;
+
+            // prune goes by last use
+            futimens(fd, NULL);
+        }
+        munmap(data, st.st_size);
+    }
+    close(fd);
+    return hit;
+}
+
+/*
+ * cachestore - Keep a result under key. It is written to a private
+ *     file and renamed into place, so a reader never sees half of it.
+ */
+void cachestore(char *key, char *data, long long len, int status)
+{
+    char dir[MAXLINE], tmp[MAXLINE + 64], path[MAXLINE + 32];
+    struct cachehdr_t hdr;
+    int fd, ok;
+
+    if (cachedir(dir) < 0)
+        return;
+    snprintf(tmp, sizeof(tmp), "%s/.%s.%d", dir, key, (int)getpid());
+    snprintf(path, sizeof(path), "%s/%s", dir, key);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return;
+
+    hdr.magic = CACHEMAGIC;
+    hdr.status = status;
+    hdr.len = len;
+    ok = (write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+          (len == 0 || write(fd, data, len) == len));
+    if (close(fd) < 0 || !ok || rename(tmp, path) < 0)
+    {
+        unlink(tmp);
+        return;
+    }
+    cache_stored++;
+}
+
+/*
+ * xxh64 - The XXH64 hash of len bytes at data, seeded with seed
+ */
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+#define XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define XXH_ROUND(acc, in) XXH_ROTL((acc) + (in) * XXH_P2, 31) * XXH_P1
+uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+    const unsigned char *p = data, *end = p + len;
+    uint64_t h, v[4], k;
+    uint32_t w;
+    int i;
+
+    if (len >= 32)
+    {
+        // four lanes over each 32-byte stripe
+        v[0] = seed + XXH_P1 + XXH_P2;
+        v[1] = seed + XXH_P2;
+        v[2] = seed;
+        v[3] = seed - XXH_P1;
+        for (; p + 32 <= end; p += 32)
+        {
+            for (i = 0; i < 4; i++)
+            {
+                memcpy(&k, p + 8 * i, 8);
+                v[i] = XXH_ROUND(v[i], k);
+            }
+        }
+        h = XXH_ROTL(v[0], 1) + XXH_ROTL(v[1], 7) + XXH_ROTL(v[2], 12) + XXH_ROTL(v[3], 18);
+        for (i = 0; i < 4; i++)
+            h = (h ^ XXH_ROUND(0, v[i])) * XXH_P1 + XXH_P4;
+    }
+    else
+    {
+        h = seed + XXH_P5;
+    }
+    h += len;
+
+    // then the tail, 8, 4 and 1 bytes at a time
+    for (; p + 8 <= end; p += 8)
+    {
+        memcpy(&k, p, 8);
+        h ^= XXH_ROUND(0, k);
+        h = XXH_ROTL(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end)
+    {
+        memcpy(&w, p, 4);
+        h ^= (uint64_t)w * XXH_P1;
+        h = XXH_ROTL(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h ^= *p * XXH_P5;
+        h = XXH_ROTL(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ * do_cache - Execute the builtin cache command
+ *     cache stats          hit rate since startup and what is stored
+ *     cache prune [days]   remove results unused for that many days
+ *                          (all of them by default)
+ */
+void do_cache(char **argv)
+{
+    char dir[MAXLINE];
+    struct dirent *ent;
+    struct stat st;
+    unsigned long entries = 0, pruned = 0;
+    long long bytes = 0;
+    time_t cutoff;
+    DIR *d;
+
+    if (argv[1] == NULL ||
+        (strcmp(argv[1], "stats") != 0 && strcmp(argv[1], "prune") != 0))
+    {
+        printf("usage: cache stats|prune [days]\n");
+        laststatus = 2;
+        return;
+    }
+    if (cachedir(dir) < 0 || (d = opendir(dir)) == NULL)
+    {
+        printf("cache: no cache directory\n");
+        laststatus = 1;
+        return;
+    }
+
+    cutoff = time(NULL) - (argv[2] != NULL ? atol(argv[2]) * 86400 : 0);
+    while ((ent = readdir(d)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 ||
+            fstatat(dirfd(d), ent->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+
+        // entries are aged by last use; leftover private files go too
+        if (strcmp(argv[1], "prune") == 0 &&
+            (ent->d_name[0] == '.' || argv[2] == NULL || st.st_mtime < cutoff))
+        {
+            if (unlinkat(dirfd(d), ent->d_name, 0) == 0 && ent->d_name[0] != '.')
+                pruned++;
+            continue;
+        }
+        if (ent->d_name[0] != '.')
+        {
+            entries++;
+            bytes += st.st_size;
+        }
+    }
+    closedir(d);
+
+    if (strcmp(argv[1], "prune") == 0)
+    {
+        printf("cache: pruned %lu, kept %lu (%lld bytes)\n", pruned, entries, bytes);
+        return;
+    }
+    printf("cache: %lu hits, %lu misses (%.1f%% hit rate), %lu stored\n",
+           cache_hits, cache_misses,
+           cache_hits + cache_misses > 0 ? 100.0 * cache_hits / (cache_hits + cache_misses) : 0.0,
+           cache_stored);
+    printf("cache: %lu entries (%lld bytes) in %s\n", entries, bytes, dir);
+}
+
+/***************************
+ * End result cache routines
+ ***************************/
+
+/**************************
+ * Glob expansion routines
+ **************************/
+
+/*
+ * freeargs - Release the words built by buildargv, closing the pipes
+ *     of any process substitutions and then waiting for them
+ */
+void freeargs(struct args_t *args)
+{
+    char *next;
+    int i;
+
+    for (i = 0; i < args->nsubs; i++)
+        close(args->subfds[i]);
+    for (i = 0; i < args->nsubs; i++)
+        waitchild(args->subs[i]);
+    args->nsubs = 0;
+
+    while (args->chunk != NULL)
+    {
+        memcpy(&next, args->chunk, sizeof(next));
+        free(args->chunk);
+        args->chunk = next;
+    }
+    free(args->argv);
+    args->argv = NULL;
+    args->argc = args->cap = 0;
+}
+
+/*
+ * addarg - Append a word to args, keeping argv NULL-terminated
+ */
+void addarg(struct args_t *args, char *word)
+{
+    char **argv;
+
+    if (args->argc + 1 >= args->cap)
+    {
+        args->cap = args->cap ? 2 * args->cap : 16;
+        if ((argv = realloc(args->argv, args->cap * sizeof(char *))) == NULL)
+            unix_error("realloc error");
+        args->argv = argv;
+    }
+    args->argv[args->argc++] = word;
+    args->argv[args->argc] = NULL;
+}
+
+/*
+ * savearg - Copy len bytes of word into the arena of args. Chunks
+ *     never move, so earlier words stay where they are.
+ */
+char *savearg(struct args_t *args, const char *word, size_t len)
+{
+    size_t size;
+    char *chunk, *dst;
+
+    if (args->chunk == NULL || args->used + len + 1 > args->size)
+    {
+        size = sizeof(char *) + len + 1;
+        if (size < ARENACHUNK)
+            size = ARENACHUNK;
+        if ((chunk = malloc(size)) == NULL)
+            unix_error("malloc error");
+        memcpy(chunk, &args->chunk, sizeof(char *));
+        args->chunk = chunk;
+        args->used = sizeof(char *);
+        args->size = size;
+    }
+    dst = args->chunk + args->used;
+    memcpy(dst, word, len);
+    dst[len] = '\0';
+    args->used += len + 1;
+    return dst;
+}
+
+/*
+ * expandbraces - Expand the first {a,b,...} in word into one word per
+ *     alternative, recursively, and glob each result. Braces without
+ *     a comma at their own level are left as they are.
+ */
+void expandbraces(struct args_t *args, const char *word)
+{
+    char out[MAXLINE];
+    const char *open, *close = NULL, *alt, *p;
+    int depth, commas;
+
+    for (open = strchr(word, '{'); open != NULL; open = strchr(open + 1, '{'))
+    {
+        depth = 0;
+        commas = 0;
+        for (close = open; *close != '\0'; close++)
+        {
+            if (*close == '{')
+                depth++;
+            else if (*close == '}' && --depth == 0)
+                break;
+            else if (*close == ',' && depth == 1)
+                commas++;
+        }
+        if (*close == '}' && commas > 0)
+            break;
+    }
+    if (open == NULL)
+    {
+        globword(args, word);
+        return;
+    }
+
+    // each top-level alternative in turn, in the order written
+    depth = 0;
+    for (alt = p = open + 1; p <= close; p++)
+    {
+        if (*p == '{')
+        {
+            depth++;
+        }
+        else if (*p == '}' && p < close)
+        {
+            depth--;
+        }
+        else if ((*p == ',' && depth == 0) || p == close)
+        {
+            snprintf(out, sizeof(out), "%.*s%.*s%s", (int)(open - word), word,
+                     (int)(p - alt), alt, close + 1);
+            expandbraces(args, out);
+            alt = p + 1;
+        }
+    }
+}
+
+/*
+ * globword - Add the paths matching pat to args in sorted order, or
+ *     pat itself if it isn't a pattern or nothing matches
+ */
+void globword(struct args_t *args, const char *pat)
+{
+    char copy[MAXLINE], path[PATH_MAX];
+    char *comps[MAXLINE / 2 + 1];
+    int ncomps = 0, len = 0, start = args->argc;
+    char *p;
+
+    if (!isglob(pat))
+    {
+        addarg(args, savearg(args, pat, strlen(pat)));
+        return;
+    }
+
+    // split into components, walking from / or from the cwd
+    snprintf(copy, sizeof(copy), "%s", pat);
+    p = copy;
+    if (*p == '/')
+    {
+        path[len++] = '/';
+        p++;
+    }
+    path[len] = '\0';
+    comps[ncomps++] = p;
+    while ((p = strchr(p, '/')) != NULL)
+    {
+        *p++ = '\0';
+        comps[ncomps++] = p;
+    }
+
+    globwalk(args, path, len, comps, ncomps, 0, 0);
+    if (args->argc == start)
+        addarg(args, savearg(args, pat, strlen(pat)));
+    else
+        qsort(args->argv + start, args->argc - start, sizeof(char *), cmpword);
+}
+
+/*
+ * globwalk - Match components i and on below path, whose first len
+ *     bytes are in use, adding each complete match to args. Literal
+ *     components are appended without listing anything, so found
+ *     says whether path is known to exist. "**" stands for any number
+ *     of directories, symlinks to them not followed.
+ */
+void globwalk(struct args_t *args, char *path, int len, char **comps, int ncomps, int i, int found)
+{
+    struct dirlist_t *dir;
+    struct stat st;
+    char *comp, *name;
+    int k, n, isdir, star;
+
+    if (i == ncomps)
+    {
+        if (found || lstat(path, &st) == 0)
+            addarg(args, savearg(args, path, len));
+        return;
+    }
+
+    comp = comps[i];
+    if (!isglob(comp))
+    {
+        if ((n = joinpath(path, len, comp)) >= 0)
+            globwalk(args, path, n, comps, ncomps, i + 1, 0);
+        path[len] = '\0';
+        return;
+    }
+
+    // "**" may also match no directory at all
+    star = (strcmp(comp, "**") == 0);
+    if (star && i + 1 < ncomps)
+        globwalk(args, path, len, comps, ncomps, i + 1, found);
+
+    if ((dir = readlisting(len > 0 ? path : ".")) == NULL)
+        return;
+    dir->busy++;
+    for (k = 0; k < dir->n; k++)
+    {
+        // dot files only match a pattern that asks for them
+        name = dir->names + dir->offs[k];
+        if (name[0] == '.' && comp[0] != '.')
+            continue;
+        if (!star && !globmatch(comp, name))
+            continue;
+        if ((n = joinpath(path, len, name)) < 0)
+            continue;
+
+        // only a walk that goes on needs to know, so the last component
+        // costs no syscalls
+        if (!star && i + 1 == ncomps)
+            isdir = 0;
+        else if (dir->types[k] == DT_DIR)
+            isdir = 1;
+        else if (dir->types[k] == DT_UNKNOWN || (!star && dir->types[k] == DT_LNK))
+            isdir = ((star ? lstat(path, &st) : stat(path, &st)) == 0 && S_ISDIR(st.st_mode));
+        else
+            isdir = 0;
+
+        if (i + 1 == ncomps)
+            addarg(args, savearg(args, path, n));
+        if (star && isdir)
+            globwalk(args, path, n, comps, ncomps, i, 1);
+        else if (!star && isdir && i + 1 < ncomps)
+            globwalk(args, path, n, comps, ncomps, i + 1, 1);
+        path[len] = '\0';
+    }
+    dir->busy--;
+}
+
+/*
+ * joinpath - Append "/name" to the first len bytes of path. Returns
+ *     the new length, or -1 if it won't fit.
+ */
+int joinpath(char *path, int len, const char *name)
+{
+    int n = strlen(name);
+
+    if (len > 0 && path[len - 1] != '/')
+        path[len++] = '/';
+    if (len + n >= PATH_MAX)
+        return -1;
+    memcpy(path + len, name, n + 1);
+    return len + n;
+}
+
+/*
+ * isglob - Return true if s has a *, a ? or a complete [...] class
+ */
+int isglob(const char *s)
+{
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '*' || *s == '?')
+            return 1;
+        if (*s == '[' && s[1] != '\0' && strchr(s + 2, ']') != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * globmatch - Return true if name matches pat, where * is any run of
+ *     characters, ? is any one and [...] is a class
+ */
+int globmatch(const char *pat, const char *name)
+{
+    const char *star = NULL, *back = NULL;
+    int len = 0;
+
+    while (*name != '\0')
+    {
+        if (*pat == '*')
+        {
+            // remember where to retry with the star taking one more
+            star = ++pat;
+            back = name;
+            continue;
+        }
+        if (*pat == '?' ||
+            (*pat == '[' && classmatch(pat, (unsigned char)*name, &len)) ||
+            (*pat == *name && (*pat != '[' || len == 0)))
+        {
+            pat += (*pat == '[' && len > 0) ? len : 1;
+            name++;
+            continue;
+        }
+        if (star == NULL)
+            return 0;
+        pat = star;
+        name = ++back;
+    }
+    while (*pat == '*')
+        pat++;
+    return *pat == '\0';
+}
+
+/*
+ * classmatch - Match c against the class starting at p, "[abc]",
+ *     "[a-z]" or "[!...]" (also "[^...]"). Sets *len to the length of
+ *     the class, or 0 if it has no closing bracket and so is just a
+ *     '['. Returns true if c is in the class.
+ */
+int classmatch(const char *p, int c, int *len)
+{
+    const char *q = p + 1;
+    int negate = 0, match = 0;
+
+    if (*q == '!' || *q == '^')
+    {
+        negate = 1;
+        q++;
+    }
+
+    // a ] right at the start is a member
+    do
+    {
+        if (*q == '\0')
+        {
+            *len = 0;
+            return 0;
+        }
+        if (q[1] == '-' && q[2] != ']' && q[2] != '\0')
+        {
+            if ((unsigned char)q[0] <= c && c <= (unsigned char)q[2])
+                match = 1;
+            q += 3;
+        }
+        else
+        {
+            if ((unsigned char)*q == c)
+                match = 1;
+            q++;
+        }
+    } while (*q != ']');
+
+    *len = q + 1 - p;
+    return match != negate;
+}
+
+/*
+ * readlisting - Return the listing of a directory, read afresh only
+ *     if its mtime has changed since it was cached. The directory is
+ *     read with large getdents64 batches rather than an entry at a
+ *     time. Returns NULL if it can't be read or the cache is full of
+ *     listings being walked.
+ */
+struct dirlist_t *readlisting(const char *path)
+{
+    static char *dents = NULL;
+    struct dirlist_t *dir = NULL;
+    struct dirent64 *d;
+    struct stat st;
+    unsigned int *offs;
+    unsigned char *types;
+    char *names;
+    size_t used, namelen;
+    ssize_t nread, pos;
+    int i, fd;
+
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    // look the directory up by identity, so the cwd doesn't matter
+    for (i = 0; i < MAXDIRCACHE; i++)
+    {
+        if (dircache[i].names != NULL && dircache[i].dev == st.st_dev &&
+            dircache[i].ino == st.st_ino)
+        {
+            dir = &dircache[i];
+            break;
+        }
+    }
+    if (dir != NULL && (dir->busy || (dir->mtime.tv_sec == st.st_mtim.tv_sec &&
+                                      dir->mtime.tv_nsec == st.st_mtim.tv_nsec)))
+    {
+        dir->seq = dirseq++;
+        return dir;
+    }
+
+    // otherwise reread it in place, or recycle a free slot or else
+    // the least recently used one
+    for (i = 0; dir == NULL && i < MAXDIRCACHE; i++)
+        if (dircache[i].names == NULL)
+            dir = &dircache[i];
+    if (dir == NULL)
+    {
+        for (i = 0; i < MAXDIRCACHE; i++)
+            if (!dircache[i].busy && (dir == NULL || dircache[i].seq < dir->seq))
+                dir = &dircache[i];
+        if (dir == NULL)
+            return NULL;
+    }
+
+    if (dents == NULL && (dents = malloc(DENTSIZE)) == NULL)
+        return NULL;
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return NULL;
+    if (dir->names == NULL)
+    {
+        dir->size = 4096;
+        if ((dir->names = malloc(dir->size)) == NULL)
+        {
+            close(fd);
+            return NULL;
+        }
+    }
+    dir->n = 0;
+    used = 0;
+    while ((nread = getdents64(fd, dents, DENTSIZE)) > 0)
+    {
+        for (pos = 0; pos < nread; pos += d->d_reclen)
+        {
+            d = (struct dirent64 *)(dents + pos);
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+
+            // grow the arrays geometrically
+            namelen = strlen(d->d_name) + 1;
+            if (dir->n == dir->cap)
             {
-                unix_error("continue in background error");
+                dir->cap = dir->cap ? 2 * dir->cap : 256;
+                offs = realloc(dir->offs, dir->cap * sizeof(*offs));
+                types = realloc(dir->types, dir->cap);
+                if (offs != NULL)
+                    dir->offs = offs;
+                if (types != NULL)
+                    dir->types = types;
+                if (offs == NULL || types == NULL)
+                    break;
+            }
+            if (used + namelen > dir->size)
+            {
+                dir->size = (dir->size ? 2 * dir->size : 4096) + namelen;
+                if ((names = realloc(dir->names, dir->size)) == NULL)
+                    break;
+                dir->names = names;
             }
+            memcpy(dir->names + used, d->d_name, namelen);
+            dir->offs[dir->n] = used;
+            dir->types[dir->n++] = d->d_type;
+            used += namelen;
         }
-        else
+        if (pos < nread)
+            break;
+    }
+    close(fd);
+
+    // a listing we couldn't finish isn't kept
+    if (nread != 0)
+    {
+        free(dir->names);
+        dir->names = NULL;
+        dir->n = 0;
+        return NULL;
+    }
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    dir->mtime = st.st_mtim;
+    dir->seq = dirseq++;
+    return dir;
+}
+
+/*
+ * cmpword - qsort comparison of two words
+ */
+int cmpword(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/******************************
+ * End glob expansion routines
+ ******************************/
+
+/****************
+ * Watch routines
+ ****************/
+
+/*
+ * do_watch - Execute the builtin watch command, "watch path ... --
+ *     cmd [args]", in the job it runs as. The command is run at once
+ *     and, after each burst of changes to the paths has been quiet
+ *     for WATCHQUIET ms, its process group is stopped and it is run
+ *     again. The command has a group of its own so it can be
+ *     replaced, and the job's ctrl-c, ctrl-z and continue are passed
+ *     on to it. The job ends when it is interrupted or terminated.
+ */
+void do_watch(char **argv)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char **cmd = NULL;
+    struct pollfd fds[2];
+    struct timespec quiet, *timeout;
+    sigset_t mask, prev;
+    int i, ifd, npaths, pidfd = -1, dirty, sig;
+    pid_t pid;
+
+    for (i = 1; argv[i] != NULL && cmd == NULL; i++)
+        if (strcmp(argv[i], "--") == 0)
+            cmd = &argv[i + 1];
+    npaths = i - 2;
+    if (cmd == NULL || cmd[0] == NULL || npaths < 1)
+    {
+        printf("usage: watch path ... -- cmd [args]\n");
+        laststatus = 2;
+        return;
+    }
+
+    // the job is just this process; drop the shell's state
+    sigemptyset(&mask);
+    entersubshell(&mask);
+
+    if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+        unix_error("inotify error");
+    for (i = 1; i <= npaths; i++)
+    {
+        if (inotify_add_watch(ifd, argv[i], IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                                                IN_CREATE | IN_DELETE | IN_MOVE |
+                                                IN_DELETE_SELF | IN_MOVE_SELF) < 0)
         {
-            // continue in the foreground
-            if (kill(-(job->pid), SIGCONT) == 0)
+            printf("watch: %s: %s\n", argv[i], strerror(errno));
+            exit(1);
+        }
+    }
+
+    // job control signals only arrive while we wait below
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTSTP);
+    sigaddset(&mask, SIGCONT);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    Signal(SIGINT, watch_handler);
+    Signal(SIGTERM, watch_handler);
+    Signal(SIGHUP, watch_handler);
+    Signal(SIGTSTP, watch_handler);
+    Signal(SIGCONT, watch_handler);
+
+    pid = watch_start(cmd, &pidfd);
+    quiet.tv_sec = WATCHQUIET / 1000;
+    quiet.tv_nsec = (WATCHQUIET % 1000) * 1000000L;
+    dirty = 0;
+    while (1)
+    {
+        fds[0].fd = ifd;
+        fds[0].events = POLLIN;
+        fds[1].fd = pidfd;
+        fds[1].events = POLLIN;
+        timeout = dirty ? &quiet : NULL;
+        if (ppoll(fds, 2, timeout, &prev) == 0)
+        {
+            // the burst is over: replace the running instance
+            watch_stop(pid, pidfd, SIGTERM);
+            pid = watch_start(cmd, &pidfd);
+            dirty = 0;
+            continue;
+        }
+
+        for (sig = 1; sig < NSIG; sig++)
+        {
+            if (!watchsig[sig])
+                continue;
+            watchsig[sig] = 0;
+            if (sig == SIGTSTP)
             {
-                // set the job state to foreground
-                job->state = FG;
+                // stop with the command, so the shell sees us stop
+                if (pid > 0)
+                    kill(-pid, SIGTSTP);
+                Signal(SIGTSTP, SIG_DFL);
+                kill(getpid(), SIGTSTP);
+                sigprocmask(SIG_SETMASK, &prev, NULL);
+                sigprocmask(SIG_BLOCK, &mask, NULL);
+                Signal(SIGTSTP, watch_handler);
+
+                // we are back, so bg or fg continued the job
+                if (pid > 0)
+                    kill(-pid, SIGCONT);
+                watchsig[SIGCONT] = 0;
+            }
+            else if (sig == SIGCONT)
+            {
+                if (pid > 0)
+                    kill(-pid, SIGCONT);
+            }
+            else
+            {
+                // take the command down with us, then die the same way
+                watch_stop(pid, pidfd, sig);
+                Signal(sig, SIG_DFL);
+                sigprocmask(SIG_SETMASK, &prev, NULL);
+                kill(getpid(), sig);
+                exit(128 + sig);
+            }
+        }
+
+        // a finished command waits for the next change
+        if (pid > 0 && (fds[1].revents & POLLIN))
+        {
+            waitpid(pid, NULL, 0);
+            close(pidfd);
+            pid = 0;
+            pidfd = -1;
+        }
+
+        // every read restarts the quiet period; watches on files that
+        // were replaced are added again
+        if (fds[0].revents & POLLIN)
+        {
+            while (read(ifd, buf, sizeof(buf)) > 0)
+                ;
+            for (i = 1; i <= npaths; i++)
+                inotify_add_watch(ifd, argv[i], IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                                                    IN_CREATE | IN_DELETE | IN_MOVE |
+                                                    IN_DELETE_SELF | IN_MOVE_SELF);
+            dirty = 1;
+        }
+    }
+}
+
+/*
+ * watch_start - Fork argv in a process group of its own, with the
+ *     signal mask and handlers it would get from the shell. Returns
+ *     its pid and sets *pidfd, or returns 0 if it couldn't start.
+ */
+pid_t watch_start(char **argv, int *pidfd)
+{
+    sigset_t empty;
+    pid_t pid;
+    int i;
+
+    fflush(stdout);
+    if ((pid = fork()) == 0)
+    {
+        setpgid(0, 0);
+        for (i = 1; i < NSIG; i++)
+            if (i != SIGKILL && i != SIGSTOP)
+                signal(i, SIG_DFL);
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        execcmd(argv);
+    }
+    if (pid < 0)
+    {
+        *pidfd = -1;
+        return 0;
+    }
+    setpgid(pid, pid);
+    *pidfd = open_pidfd(pid);
+    return pid;
+}
+
+/*
+ * watch_stop - Send sig to a watched command's process group and reap
+ *     it, killing it outright if it hasn't gone within a second
+ */
+void watch_stop(pid_t pid, int pidfd, int sig)
+{
+    struct pollfd pfd;
+
+    if (pid <= 0)
+        return;
+    kill(-pid, sig);
+    kill(-pid, SIGCONT);
+    pfd.fd = pidfd;
+    pfd.events = POLLIN;
+    if (pidfd < 0 || poll(&pfd, 1, 1000) == 0)
+        kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    if (pidfd >= 0)
+        close(pidfd);
+}
+
+/*
+ * watch_handler - Note a job control signal for do_watch to pass on
+ */
+void watch_handler(int sig)
+{
+    watchsig[sig] = 1;
+}
+
+/********************
+ * End watch routines
+ ********************/
+
+/*******************
+ * Variable routines
+ *******************/
+
+/*
+ * compilevars - Copy len bytes of an unquoted word from src to dst,
+ *     replacing each $name, ${name} and $? by VARMARK and the slot
+ *     number plus one. Anything else after a '$' is kept as it is.
+ *     Returns the new length, which is never more than len; *found
+ *     is set if there was a reference.
+ */
+int compilevars(char *dst, const char *src, int len, int *found)
+{
+    const char *end = src + len, *name;
+    int n = 0, namelen, brace, slot;
 
-                // wait for the job to finish in the foreground
-                waitfg(job->pid);
-            }
-            else
-            {
-                unix_error("continue in the foreground error");
-            }
+    *found = 0;
+    while (src < end)
+    {
+        // measure the name after a '$', if there is one
+        brace = (*src == '$' && src + 1 < end && src[1] == '{');
+        name = src + 1 + brace;
+        namelen = 0;
+        if (*src == '$' && name < end && *name == '?')
+            namelen = 1;
+        else if (*src == '$')
+            while (name + namelen < end &&
+                   (name[namelen] == '_' || isalpha((unsigned char)name[namelen]) ||
+                    (namelen > 0 && isdigit((unsigned char)name[namelen]))))
+                namelen++;
+
+        if (namelen == 0 || (brace && (name + namelen == end || name[namelen] != '}')) ||
+            (slot = varslot(name, namelen)) < 0)
+        {
+            dst[n++] = *src++;
+            continue;
         }
+        dst[n++] = VARMARK;
+        dst[n++] = slot + 1;
+        src = name + namelen + brace;
+        *found = 1;
     }
+    dst[n] = '\0';
+    return n;
 }
 
 /*
- * waitfg - Block until process pid is no longer the foreground process
+ * varslot - Return the slot for a variable name, giving it a new one
+ *     the first time, or -1 if the name is not valid or there are no
+ *     slots left. Slots are never freed, so cached plans stay valid.
  */
-void waitfg(pid_t pid)
+int varslot(const char *name, int len)
 {
-    // get and store the job
-    struct job_t *job = getjobpid(jobs, pid);
+    int i;
+
+    if (len == 0 || len >= VARNAME || isdigit((unsigned char)*name))
+        return -1;
+    for (i = 0; i < len && !(len == 1 && *name == '?'); i++)
+        if (name[i] != '_' && !isalnum((unsigned char)name[i]))
+            return -1;
+
+    for (i = 0; i < nvars; i++)
+        if (strncmp(vars[i].name, name, len) == 0 && vars[i].name[len] == '\0')
+            return i;
+    if (nvars == MAXVARS)
+        return -1;
+    memcpy(vars[nvars].name, name, len);
+    vars[nvars].name[len] = '\0';
+    vars[nvars].value = NULL;
+    return nvars++;
+}
+
+/*
+ * setvar - Bind a value to a variable slot
+ */
+void setvar(int slot, const char *value)
+{
+    free(vars[slot].value);
+    if ((vars[slot].value = strdup(value)) == NULL)
+        unix_error("strdup error");
+}
+
+/*
+ * varvalue - Return the value of a variable slot: $? is the last exit
+ *     status, formatted into buf, and a variable that was never set
+ *     comes from the environment, or is empty
+ */
+const char *varvalue(int slot, char *buf)
+{
+    const char *value;
 
-    // return if the job has already completed
-    if (job == NULL)
+    if (strcmp(vars[slot].name, "?") == 0)
     {
-        return;
+        sprintf(buf, "%d", laststatus);
+        return buf;
     }
+    if (vars[slot].value != NULL)
+        return vars[slot].value;
+    return (value = getenv(vars[slot].name)) != NULL ? value : "";
+}
 
-    // wait for job to leave foreground and check that process is the same
-    while (job->state == FG && job->pid == pid)
+/*
+ * expandvars - Return a compiled word with its variable references
+ *     replaced by their values, saved in the args arena
+ */
+char *expandvars(struct args_t *args, const char *word)
+{
+    char status[16], *out, *res;
+    const char *p, *value;
+    size_t len = 0, n;
+
+    // measure, then fill
+    for (p = word; *p != '\0'; p++)
+    {
+        if (*p == VARMARK && p[1] != '\0')
+            len += strlen(varvalue(*++p - 1, status));
+        else
+            len++;
+    }
+    if ((out = malloc(len + 1)) == NULL)
+        unix_error("malloc error");
+    for (p = word, n = 0; *p != '\0'; p++)
     {
-        sleep(1);
+        if (*p == VARMARK && p[1] != '\0')
+        {
+            value = varvalue(*++p - 1, status);
+            memcpy(out + n, value, strlen(value));
+            n += strlen(value);
+        }
+        else
+        {
+            out[n++] = *p;
+        }
     }
+    res = savearg(args, out, n);
+    free(out);
+    return res;
 }
 
-/*****************
- * Signal handlers
- *****************/
+/***********************
+ * End variable routines
+ ***********************/
+
+/*********************
+ * Statistics routines
+ *********************/
 
 /*
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.
+ * nowns - Return the monotonic clock in ns. Safe in signal handlers.
  */
-void sigchld_handler(int sig)
+long long nowns(void)
 {
-    // set up all local variables
-    struct job_t *job;
-    pid_t pid;
-    int jid;
-    int status;
+    struct timespec ts;
 
-    // check if any child process changes state
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0)
-    {
-        // get the job id for later
-        jid = pid2jid(pid);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-        // check if the process finished
-        if (WIFEXITED(status))
+/*
+ * histadd - Record a value in a histogram. It only does arithmetic,
+ *     so the signal handlers can call it.
+ */
+void histadd(struct hist_t *h, long long ns)
+{
+    if (ns < 0)
+        ns = 0;
+    h->buckets[histbucket(ns)]++;
+    h->count++;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+/*
+ * histbucket - Return the bucket for a value. Values below
+ *     2^HISTSUB have a bucket each; above that, each power of two is
+ *     split into 2^HISTSUB buckets, so a value is off by at most 1 in
+ *     2^HISTSUB.
+ */
+int histbucket(long long ns)
+{
+    int msb;
+
+    if (ns < (1 << HISTSUB))
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - HISTSUB + 1) << HISTSUB) + (int)(ns >> (msb - HISTSUB)) - (1 << HISTSUB);
+}
+
+/*
+ * histvalue - Return the largest value that falls in bucket b
+ */
+long long histvalue(int b)
+{
+    int shift;
+
+    if (b < (1 << HISTSUB))
+        return b;
+    shift = (b >> HISTSUB) - 1;
+    return ((long long)((b & ((1 << HISTSUB) - 1)) + (1 << HISTSUB)) << shift) + (1LL << shift) - 1;
+}
+
+/*
+ * histpct - Return the value below which pct percent of a histogram's
+ *     values fall, or 0 if it is empty
+ */
+long long histpct(struct hist_t *h, double pct)
+{
+    unsigned long seen = 0, target;
+    long long value;
+    int b;
+
+    if (h->count == 0)
+        return 0;
+    target = (unsigned long)(h->count * pct / 100.0);
+    if (target < h->count * pct / 100.0 || target < 1)
+        target++;
+    for (b = 0; b < HISTBUCKETS; b++)
+    {
+        if ((seen += h->buckets[b]) >= target)
         {
-            // delete the job
-            deletejob(jobs, pid);
+            value = histvalue(b);
+            return value < h->max ? value : h->max;
         }
-        // check if the process was interrupted
-        else if (WIFSIGNALED(status))
+    }
+    return h->max;
+}
+
+/*
+ * fmtns - Format a duration for people into buf. Returns buf.
+ */
+char *fmtns(long long ns, char *buf)
+{
+    if (ns < 1000)
+        sprintf(buf, "%lldns", ns);
+    else if (ns < 1000000)
+        sprintf(buf, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        sprintf(buf, "%.1fms", ns / 1e6);
+    else
+        sprintf(buf, "%.2fs", ns / 1e9);
+    return buf;
+}
+
+/*
+ * do_stats - Execute the builtin stats command: print the counters
+ *     and the p50, p99 and max of each latency histogram, as a table
+ *     or as one line of JSON. -reset zeroes everything, after printing
+ *     when -json is also given, so a scraper can read and clear at once.
+ */
+void do_stats(char **argv)
+{
+    struct hist_t *hists[] = {&hist_spawn, &hist_reap, &hist_fgwait, &hist_forward, &hist_lifetime};
+    char *names[] = {"spawn", "reap", "fgwait", "forward", "lifetime"};
+    char p50[32], p99[32], max[32];
+    int i, json = 0, reset = 0;
+    sigset_t mask, prev;
+
+    for (i = 1; argv[i] != NULL; i++)
+    {
+        if (strcmp(argv[i], "-json") == 0)
+            json = 1;
+        else if (strcmp(argv[i], "-reset") == 0)
+            reset = 1;
+        else
         {
-            // delete the job and print the confirmation
-            if (deletejob(jobs, pid))
-            {
-                safe_write("Job [", 5);
-                safe_write_int(jid);
-                safe_write("] (", 3);
-                safe_write_int(pid);
-                safe_write(") terminated by signal ", 23);
-                safe_write_int(WTERMSIG(status));
-                safe_write("\n", 1);
-            }
+            printf("usage: stats [-reset] [-json]\n");
+            laststatus = 2;
+            return;
         }
-        // check if the process was stopped
-        else if (WIFSTOPPED(status))
-        {
-            // get the job for processing
-            job = getjobpid(jobs, pid);
+    }
 
-            // check the job exists and print a stop confirmation
-            if (job != NULL)
-            {
-                job->state = ST;
-                safe_write("Job [", 5);
-                safe_write_int(jid);
-                safe_write("] (", 3);
-                safe_write_int(pid);
-                safe_write(") stopped by signal ", 20);
-                safe_write_int(WSTOPSIG(status));
-                safe_write("\n", 1);
-            }
-        }
+    // the SIGCHLD, SIGINT and SIGTSTP handlers record into these, so
+    // keep them all out meanwhile
+    if (sigemptyset(&mask) != 0 || sigaddset(&mask, SIGCHLD) != 0 ||
+        sigaddset(&mask, SIGINT) != 0 || sigaddset(&mask, SIGTSTP) != 0)
+    {
+        unix_error("sigset error");
+    }
+    if (sigprocmask(SIG_BLOCK, &mask, &prev) != 0)
+    {
+        unix_error("sigprocmask blocking error");
+    }
+    if (json)
+    {
+        printf("{\"launched\":%lu,\"reaped\":%lu,\"table_full\":%lu,\"coalesced\":%lu,"
+               "\"plans_parsed\":%lu,\"plans_reused\":%lu,\"parse_ns\":%lld",
+               stats_launched, stats_reaped, stats_tablefull, stats_coalesced,
+               plan_misses, plan_hits, parse_ns);
+        for (i = 0; i < 5; i++)
+            printf(",\"%s\":{\"count\":%lu,\"p50_ns\":%lld,\"p99_ns\":%lld,\"max_ns\":%lld}",
+                   names[i], hists[i]->count, histpct(hists[i], 50), histpct(hists[i], 99),
+                   hists[i]->max);
+        printf("}\n");
+    }
+    else if (!reset)
+    {
+        printf("jobs: %lu launched, %lu reaped, %lu refused (table full), %lu coalesced SIGCHLDs\n",
+               stats_launched, stats_reaped, stats_tablefull, stats_coalesced);
+        printf("lines: %lu parsed in %s, %lu reused a cached plan\n",
+               plan_misses, fmtns(parse_ns, p50), plan_hits);
+        printf("%-8s %8s %8s %8s %8s\n", "", "count", "p50", "p99", "max");
+        for (i = 0; i < 5; i++)
+            printf("%-8s %8lu %8s %8s %8s\n", names[i], hists[i]->count,
+                   fmtns(histpct(hists[i], 50), p50), fmtns(histpct(hists[i], 99), p99),
+                   fmtns(hists[i]->max, max));
     }
+
+    if (reset)
+    {
+        for (i = 0; i < 5; i++)
+            memset(hists[i], 0, sizeof(struct hist_t));
+        stats_launched = stats_reaped = stats_tablefull = stats_coalesced = 0;
+        plan_hits = plan_misses = 0;
+        parse_ns = 0;
+    }
+    restore_mask(&prev);
 }
 
+/*************************
+ * End statistics routines
+ *************************/
+
+/*************************
+ * Output capture routines
+ *************************/
+
 /*
- * safe_write - Uses the write system call to print out messages in
- *      an async-signal-safe way.
+ * initlogs - Mark every capture log as free
  */
-void safe_write(char *str, int size)
+void initlogs(void)
 {
-    // use write to safely print a message
-    if (write(STDOUT_FILENO, str, size) == -1)
+    int i;
+
+    for (i = 0; i < MAXLOGS; i++)
     {
-        unix_error("write error");
+        logs[i].fd = -1;
+        logs[i].pid = 0;
+        logs[i].ring = NULL;
     }
 }
 
 /*
- * safe_write_int - On the fly calculates a string from a given int
- *      and prints it using better print.
+ * newlog - Find a log for a new capture: a free slot, or else the
+ *     oldest fully drained log whose job is gone. Returns NULL if
+ *     every log is still in use.
  */
-void safe_write_int(int value)
+struct joblog_t *newlog(void)
 {
-    // buffer to hold the string
-    char buffer[20];
-    int i = 0;
+    struct joblog_t *log = NULL;
+    int i;
 
-    // check for negative
-    if (value < 0)
+    for (i = 0; i < MAXLOGS; i++)
     {
-        // print the '-' and convert to positive
-        safe_write("-", 1);
-        value = -value;
+        if (logs[i].pid == 0)
+        {
+            log = &logs[i];
+            break;
+        }
+        if (logs[i].fd < 0 && getjobpid(jobs, logs[i].pid) == NULL &&
+            (log == NULL || logs[i].seq < log->seq))
+        {
+            log = &logs[i];
+        }
     }
+    if (log == NULL)
+        return NULL;
 
-    // convert the integer to a string in reverse order
-    do
-    {
-        buffer[i++] = '0' + (value % 10);
-        value /= 10;
-    } while (value > 0);
+    // rings are allocated on first use and then recycled
+    if (log->ring == NULL && (log->ring = malloc(LOGSIZE)) == NULL)
+        return NULL;
+    log->fd = -1;
+    log->jid = 0;
+    log->pid = 0;
+    log->total = 0;
+    log->seq = logseq++;
+    log->tee = 0;
+    return log;
+}
 
-    // safely print the string in reverse order
-    while (i > 0)
+/*
+ * findlog - Find the log named by a %jid or pid argument, preferring
+ *     the newest when a job ID has been reused
+ */
+struct joblog_t *findlog(char *arg)
+{
+    struct joblog_t *log = NULL;
+    int i, jid = 0;
+    pid_t pid = 0;
+
+    if (arg[0] == '%')
+        jid = atoi(arg + 1);
+    else
+        pid = atoi(arg);
+
+    for (i = 0; i < MAXLOGS; i++)
     {
-        safe_write(&buffer[--i], 1);
+        if (logs[i].pid == 0)
+            continue;
+        if ((jid > 0 && logs[i].jid == jid) || (pid > 0 && logs[i].pid == pid))
+        {
+            if (log == NULL || logs[i].seq > log->seq)
+                log = &logs[i];
+        }
     }
+    return log;
 }
 
 /*
- * sigint_handler - The kernel sends a SIGINT to the shell whenever the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.
+ * drainlog - Move what a job has written into its ring with large
+ *     non-blocking reads, up to a ring's worth per call so a job that
+ *     never stops writing can't hold up the event loop. Output of a
+ *     job that has been brought to the foreground, or of a cache
+ *     miss, is shown as it arrives. Returns nonzero if it stopped
+ *     with output possibly left in the pipe.
  */
-void sigint_handler(int sig)
+int drainlog(struct joblog_t *log)
 {
-    // get the current fg job's pid
-    pid_t fg_pid = fgpid(jobs);
+    static char buf[READSIZE];
+    struct job_t *job;
+    long long off;
+    int n, first, moved = 0;
 
-    // check that the process exists
-    if (fg_pid > 0)
+    while (moved < LOGSIZE && (n = read(log->fd, buf, READSIZE)) > 0)
     {
-        // send the interrupt signal to the process
-        if (kill(-fg_pid, SIGINT) == -1)
+        // copy into the ring, wrapping at most once since a read is
+        // never larger than the ring
+        off = log->total % LOGSIZE;
+        first = (n < LOGSIZE - off) ? n : LOGSIZE - off;
+        memcpy(log->ring + off, buf, first);
+        memcpy(log->ring, buf + first, n - first);
+        log->total += n;
+
+        job = getjobpid(jobs, log->pid);
+        if (log->tee || (job != NULL && job->state == FG))
         {
-            unix_error("failed to interrupt");
+            fflush(stdout);
+            safe_write(buf, n);
         }
+        moved += n;
+    }
+    if (moved >= LOGSIZE)
+        return 1;
+
+    // end of file: every writer is gone
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
+    {
+        close(log->fd);
+        log->fd = -1;
     }
+    return 0;
 }
 
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.
+ * do_logs - Execute the builtin logs command: replay what a job has
+ *     written, and with -f keep printing new output until the job
+ *     closes it or ctrl-c is typed
  */
-void sigtstp_handler(int sig)
+void do_logs(char **argv)
 {
-    // get the current fg job's pid
-    pid_t fg_pid = fgpid(jobs);
+    struct joblog_t *log;
+    long long pos, end, lost;
+    int follow, len;
+    sigset_t prev;
 
-    // check that the process exists
-    if (fg_pid > 0)
+    if (argv[1] == NULL)
     {
-        // send the stop signal to the process
-        if (kill(-fg_pid, SIGTSTP) == -1)
+        printf("%s command requires PID or %cjobid argument\n", argv[0], '%');
+        return;
+    }
+    follow = (argv[2] != NULL && strcmp(argv[2], "-f") == 0);
+    if ((log = findlog(argv[1])) == NULL)
+    {
+        printf("%s: No captured output\n", argv[1]);
+        return;
+    }
+
+    block_sigchld(&prev);
+    interrupted = 0;
+    pos = 0;
+    while (1)
+    {
+        // pick up whatever is sitting in the pipe
+        if (log->fd >= 0)
+            drainlog(log);
+
+        // say so if the ring has already overwritten part of it
+        end = log->total;
+        if ((lost = end - LOGSIZE - pos) > 0)
         {
-            unix_error("failed to stop");
+            printf("[%lld bytes of earlier output dropped]\n", lost);
+            pos += lost;
+        }
+        fflush(stdout);
+        while (pos < end)
+        {
+            len = LOGSIZE - pos % LOGSIZE;
+            if (len > end - pos)
+                len = end - pos;
+            safe_write(log->ring + pos % LOGSIZE, len);
+            pos += len;
         }
+
+        // stop once the job is done writing or the user gives up
+        if (!follow || log->fd < 0 || interrupted)
+            break;
+        waitevent(-1, -1, NULL, &prev);
     }
+    restore_mask(&prev);
 }
 
-/*********************
- * End signal handlers
- *********************/
+/*****************************
+ * End output capture routines
+ *****************************/
 
 /***********************************************
  * Helper routines that manipulate the job list
@@ -614,8 +5147,13 @@ void sigtstp_handler(int sig)
 void clearjob(struct job_t *job)
 {
     job->pid = 0;
+    job->pidfd = -1;
     job->jid = 0;
     job->state = UNDEF;
+    job->prio = PRIO_NORMAL;
+    job->seq = 0;
+    job->start = 0;
+    job->queued = NULL;
     job->cmdline[0] = '\0';
 }
 
@@ -649,10 +5187,12 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
 
     for (i = 0; i < MAXJOBS; i++)
     {
-        if (jobs[i].pid == 0)
+        if (jobs[i].jid == 0)
         {
             jobs[i].pid = pid;
+            jobs[i].pidfd = open_pidfd(pid);
             jobs[i].state = state;
+            jobs[i].start = nowns();
             jobs[i].jid = nextjid++;
             if (nextjid > MAXJOBS)
                 nextjid = 1;
@@ -664,6 +5204,36 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
             return 1;
         }
     }
+    stats_tablefull++;
+    printf("Tried to create too many jobs\n");
+    return 0;
+}
+
+/* queuejob - Add a job that has no process yet to the job list.
+ *     Returns its jid, or 0 if the list is full. */
+int queuejob(struct job_t *jobs, int prio, char *cmdline)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+    {
+        if (jobs[i].jid == 0)
+        {
+            jobs[i].state = QU;
+            jobs[i].prio = prio;
+            jobs[i].seq = queueseq++;
+            jobs[i].jid = nextjid++;
+            if (nextjid > MAXJOBS)
+                nextjid = 1;
+            strcpy(jobs[i].cmdline, cmdline);
+            if (verbose)
+            {
+                printf("Queued job [%d] %s", jobs[i].jid, jobs[i].cmdline);
+            }
+            return jobs[i].jid;
+        }
+    }
+    stats_tablefull++;
     printf("Tried to create too many jobs\n");
     return 0;
 }
@@ -680,6 +5250,8 @@ int deletejob(struct job_t *jobs, pid_t pid)
     {
         if (jobs[i].pid == pid)
         {
+            if (jobs[i].pidfd >= 0)
+                close(jobs[i].pidfd);
             clearjob(&jobs[i]);
             nextjid = maxjid(jobs) + 1;
             return 1;
@@ -747,11 +5319,14 @@ void listjobs(struct job_t *jobs)
 
     for (i = 0; i < MAXJOBS; i++)
     {
-        if (jobs[i].pid != 0)
+        if (jobs[i].jid != 0)
         {
             printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
             switch (jobs[i].state)
             {
+            case QU:
+                printf("Queued ");
+                break;
             case BG:
                 printf("Running ");
                 break;
@@ -782,10 +5357,12 @@ void listjobs(struct job_t *jobs)
  */
 void usage(void)
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpc] [-S socket]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -c   capture background job output for the logs builtin\n");
+    printf("   -S   serve job control requests on a Unix-domain socket\n");
     exit(1);
 }
 